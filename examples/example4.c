@@ -0,0 +1,64 @@
+// examples/example4.c
+#include <stdio.h>
+#include <string.h>
+#include "clirunner.h"
+
+int main(void)
+{
+    /* Definitions */
+    cli_session_t      *sess;
+    cli_expect_result_t res;
+    char *const         argv[] = { "cat", NULL };
+
+    /* The following array emulates a user that provides some input */
+    const char   *choices[] = { "1\n", "2\n", "q\n" };
+
+    /* Patterns expected back from the child, one per input */
+    cli_pattern_t answers[] = { { "1\n",      CLI_EXPECT_LITERAL, CLI_STREAM_STDOUT },
+                                { "2\n",      CLI_EXPECT_LITERAL, CLI_STREAM_STDOUT },
+                                { "^q$",      CLI_EXPECT_REGEX,   CLI_STREAM_STDOUT } };
+
+    sess = cli_session_create();
+    if (!sess)
+    {
+        perror("cli_session_create");
+        return 1;
+    }
+
+    /* No session thread: output is read on this thread */
+    cli_session_set_delivery(sess, CLI_DELIVERY_PULL, NULL);
+
+    if (cli_session_start(sess, "cat", argv, NULL) != 0)
+    {
+        perror("cli_session_start");
+        cli_session_destroy(sess);
+        return 1;
+    }
+
+    /* Each input is sent as soon as the previous answer arrives */
+    for (size_t i = 0; i < 3; ++i)
+    {
+        cli_session_write_stdin(sess,
+                                choices[i],
+                                strlen(choices[i]));
+
+        if (cli_session_expect(sess, &answers[i], 1, 3000, &res) < 0)
+        {
+            perror("cli_session_expect");
+            break;
+        }
+        printf("matched '%.*s' after %zu bytes\n",
+               (int)strcspn(res.data + res.match_off, "\n"),
+               res.data + res.match_off,
+               res.len);
+        cli_expect_result_free(&res);
+    }
+
+    /* Close stdin, cat terminates when it receives EOF */
+    cli_session_close_stdin(sess);
+    cli_session_join(sess);
+    printf("[child exited with code %d]\n", cli_session_exit_code(sess));
+    cli_session_destroy(sess);
+
+    return 0;
+}
@@ -0,0 +1,70 @@
+// examples/example5.cpp
+#include <cstdio>
+#include <string>
+#include "clirunner.hpp"
+
+using namespace clirunner;
+
+/* Each coroutine runs a one-shot command without blocking the loop */
+static Detached count_words(Loop &loop, const char *text, int *pending)
+{
+    Argv   wc = { "wc", "-w" };
+    Result res = co_await async_run(loop, std::move(wc), text);
+
+    std::printf("'%s' has %.*s", text,
+                (int)res.out().size(), res.out().data());
+    --*pending;
+}
+
+/* Reads a pull mode session until EOF, one chunk per co_await */
+static Detached drain(Loop &loop, Session &sess, std::string *collected)
+{
+    char buf[256];
+
+    for (;;)
+    {
+        std::string_view chunk = co_await sess.async_read(loop, Stream::Stdout, buf);
+        if (chunk.empty())
+            break;
+        collected->append(chunk);
+    }
+}
+
+int main()
+{
+    /* Synchronous one-shot: the Result owns (and frees) the buffers */
+    Result hello = run({ "echo", "Hello, world" });
+    std::printf("exit code: %d, stdout: %.*s",
+                hello.exit_code(), (int)hello.out().size(), hello.out().data());
+
+    /* Interactive session with a capturing lambda, stored inline */
+    std::size_t bytes = 0;
+    Session     cat;
+    cat.on_stdout([&bytes](std::string_view chunk) { bytes += chunk.size(); })
+       .on_exit([](int code) { std::printf("[cat exited with code %d]\n", code); });
+    cat.start({ "cat" });
+    cat.write("1\n2\nq\n");
+    cat.close_stdin();
+    cat.join();
+    std::printf("cat echoed %zu bytes\n", bytes);
+
+    /* Several children driven by coroutines on this single thread */
+    Loop        loop;
+    int         pending = 3;
+    std::string listing;
+    Session     ls(Delivery::Pull);
+
+    ls.start({ "ls", "/" });
+    ls.close_stdin();
+    drain(loop, ls, &listing);
+
+    count_words(loop, "one", &pending);
+    count_words(loop, "one two", &pending);
+    count_words(loop, "one two three", &pending);
+
+    loop.run();
+    std::printf("%d jobs pending, ls printed %zu bytes, exit code %d\n",
+                pending, listing.size(), ls.join());
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+// examples/example6.c
+#include <stdio.h>
+#include <unistd.h>
+#include "clirunner.h"
+
+static const char *state_name[] = { "starting", "ready", "backoff", "stopping", "stopped" };
+
+static void on_output(cli_supervisor_t *sup, int id, int stream,
+                      const char *buf, size_t n, void *user)
+{
+    (void)sup; (void)user;
+    printf("[daemon %d %s] %.*s", id, stream == CLI_STREAM_STDOUT ? "out" : "err", (int)n, buf);
+    fflush(stdout);
+}
+
+static void on_state(cli_supervisor_t *sup, int id,
+                     cli_daemon_state_t state, int exit_code, void *user)
+{
+    (void)sup; (void)user;
+    fprintf(stderr, "[daemon %d is %s, exit code %d]\n", id, state_name[state], exit_code);
+}
+
+int main(void)
+{
+    /* Definitions */
+    cli_supervisor_t   *sup;
+    cli_daemon_status_t st;
+    int                 id;
+
+    /* A flaky "server": it becomes ready, then crashes after a while */
+    char *const argv[] = { "sh", "-c",
+                           "echo booting; sleep 1; echo ready to serve; sleep 2; exit 1",
+                           NULL };
+
+    cli_daemon_opts_t opts = { .cmd            = "sh",
+                               .argv           = argv,
+                               .restart        = CLI_RESTART_ON_FAILURE,
+                               .max_restarts   = -1,
+                               .backoff_min_ms = 500,
+                               .backoff_max_ms = 4000,
+                               .ready_pattern  = "ready to serve",
+                               .on_output      = on_output,
+                               .on_state       = on_state };
+
+    sup = cli_supervisor_create();
+    if (!sup)
+    {
+        perror("cli_supervisor_create");
+        return 1;
+    }
+
+    id = cli_supervisor_add(sup, &opts);
+    if (id < 0)
+    {
+        perror("cli_supervisor_add");
+        cli_supervisor_destroy(sup);
+        return 1;
+    }
+
+    /* The daemon is restarted with exponential backoff while we wait */
+    sleep(10);
+
+    cli_supervisor_status(sup, id, &st);
+    printf("restarts: %u, current uptime: %lld ms, total uptime: %lld ms\n",
+           st.restarts, (long long)st.uptime_ms, (long long)st.total_uptime_ms);
+
+    /* Graceful stop (SIGTERM, then SIGKILL) of all daemons */
+    cli_supervisor_destroy(sup);
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+// examples/example7.c
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "clirunner.h"
+
+/* Callback for stdout */
+void on_out(cli_session_t *s, const char *buf, size_t n)
+{
+    (void)s;
+    printf("[stdout] %.*s", (int)n, buf);
+}
+
+/* Callback for the extra channels */
+void on_channel(cli_session_t *s, int child_fd, const char *buf, size_t n)
+{
+    (void)s;
+    printf("[fd %d] %.*s", child_fd, (int)n, buf);
+}
+
+/* Callback for exit */
+void on_exit_cb(cli_session_t *s, int code)
+{
+    (void)s;
+    printf("[child exited with code %d]\n", code);
+}
+
+int main(void)
+{
+    /* Definitions */
+    cli_session_t   *sess;
+    cli_callbacks_t  cb = { 0 };
+    char            *shm;
+
+    /* The child writes progress on fd 3, answers requests on fd 4 */
+    /* and leaves its report in the shared memory region on fd 5   */
+    char *const argv[] = { "sh", "-c",
+                           "echo 'working...'; "
+                           "echo 'progress 50%' >&3; "
+                           "read req <&4; echo \"reply to $req\" >&4; "
+                           "echo 'progress 100%' >&3; "
+                           "echo 'report: all good' > /proc/self/fd/5",
+                           NULL };
+
+    const cli_fd_spec_t fds[] = { { 3, CLI_FD_PIPE_OUT,   -1, 0    },
+                                  { 4, CLI_FD_SOCKETPAIR, -1, 0    },
+                                  { 5, CLI_FD_MEMFD,      -1, 4096 } };
+    const cli_spawn_opts_t opts = { .fds = fds, .nfds = 3, .on_channel = on_channel };
+
+    sess = cli_session_create();
+    if (!sess)
+    {
+        perror("cli_session_create");
+        return 1;
+    }
+
+    cli_session_set_spawn_opts(sess, &opts);
+
+    cb.on_stdout = on_out;
+    cb.on_exit = on_exit_cb;
+
+    if (cli_session_start(sess, "sh", argv, &cb) != 0)
+    {
+        perror("cli_session_start");
+        cli_session_destroy(sess);
+        return 1;
+    }
+
+    /* Send a request on the socketpair, the reply comes to on_channel() */
+    if (write(cli_session_fd(sess, 4), "status\n", 7) < 0)
+        perror("write");
+
+    cli_session_join(sess);
+
+    /* The region is shared, no copy goes through a pipe */
+    shm = cli_session_shm(sess, 5, NULL);
+    if (shm)
+        printf("[shm] %s", shm);
+
+    cli_session_destroy(sess);
+
+    return 0;
+}
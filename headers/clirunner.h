@@ -39,7 +39,9 @@
 /*****************
  * Include Files *
  *****************/
+#include <poll.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 
@@ -51,6 +53,11 @@ extern "C" {
 /*******************************
  * General Purpose Definitions *
  *******************************/
+/* Child streams, numbered as the corresponding child file descriptors */
+#define CLI_STREAM_STDIN    0
+#define CLI_STREAM_STDOUT   1
+#define CLI_STREAM_STDERR   2
+#define CLI_STREAM_ANY      (-1)    /* stdout or stderr (cli_session_expect() patterns) */
 
 
 /********************
@@ -66,6 +73,9 @@ typedef struct
     size_t  err_len;
 } oneshot_result_t;
 
+/* One-shot execution API - Non-blocking job (see oneshot_job_start()) */
+typedef struct oneshot_job oneshot_job_t;
+
 /* Interactive session API */
 typedef struct cli_session cli_session_t;
 typedef void (*cli_on_stdout)(cli_session_t *s, const char *buf, size_t n);
@@ -79,6 +89,194 @@ typedef struct
     void         *user;
 } cli_callbacks_t;
 
+/* Trace recorder - Binary I/O trace shared by any number of children */
+typedef struct cli_trace cli_trace_t;
+
+#define CLI_TRACE_PAYLOAD   0x1     /* cli_trace_open() flag: record data, not just byte counts */
+
+typedef enum
+{
+    CLI_TRACE_SPAWN = 1,      /* child started, data = command */
+    CLI_TRACE_READ,           /* output read, value = bytes */
+    CLI_TRACE_WRITE,          /* input written, value = bytes */
+    CLI_TRACE_SIGNAL,         /* signal sent, value = signal number */
+    CLI_TRACE_EOF,            /* stream closed */
+    CLI_TRACE_EXIT,           /* child reaped, value = exit code */
+    CLI_TRACE_CALLBACK        /* output callback run, value = duration in ns */
+} cli_trace_event_t;
+
+/* Trace record, as stored in the file (host byte order), followed by */
+/* len bytes of data                                                  */
+typedef struct
+{
+    uint64_t ts_ns;           /* CLOCK_MONOTONIC, at the end of the operation (start for callbacks) */
+    int64_t  value;
+    int32_t  pid;
+    uint32_t len;
+    int16_t  stream;          /* CLI_STREAM_*, channel child_fd, -1 = none */
+    uint8_t  type;            /* cli_trace_event_t */
+    uint8_t  reserved[5];
+} cli_trace_record_t;
+
+/* Trace replay - Called for each record (data holds rec->len bytes); */
+/* a non zero return value stops the replay                           */
+typedef int (*cli_trace_on_record)(const cli_trace_record_t *rec, const void *data, void *user);
+
+/* Spawn options - Extra descriptors (fd 3+) given to the child */
+typedef enum
+{
+    CLI_FD_INHERIT = 0,       /* caller descriptor parent_fd, as is */
+    CLI_FD_PIPE_IN,           /* pipe, the child reads (parent end is write only) */
+    CLI_FD_PIPE_OUT,          /* pipe, the child writes (parent end is read only) */
+    CLI_FD_SOCKETPAIR,        /* bidirectional AF_UNIX stream socket */
+    CLI_FD_MEMFD              /* shared memory region (memfd) of size bytes */
+} cli_fd_kind_t;
+
+typedef struct
+{
+    int           child_fd;   /* descriptor number in the child (>= 3) */
+    cli_fd_kind_t kind;
+    int           parent_fd;  /* CLI_FD_INHERIT only */
+    size_t        size;       /* CLI_FD_MEMFD only */
+} cli_fd_spec_t;
+
+/* Spawn options - Child stdin */
+typedef enum
+{
+    CLI_STDIN_PIPE = 0,       /* pipe written through the API (default) */
+    CLI_STDIN_NULL,           /* /dev/null */
+    CLI_STDIN_CLOSED          /* no descriptor 0 in the child */
+} cli_stdin_mode_t;
+
+/* Output of CLI_FD_PIPE_OUT and CLI_FD_SOCKETPAIR session channels */
+typedef void (*cli_on_channel)(cli_session_t *s, int child_fd, const char *buf, size_t n);
+
+typedef struct
+{
+    const cli_fd_spec_t *fds;        /* extra descriptors (may be NULL) */
+    size_t               nfds;
+    cli_on_channel       on_channel; /* sessions only (NULL = none) */
+    cli_trace_t         *trace;      /* I/O trace recorder (NULL = none) */
+    int                  merge_stderr; /* non zero: stderr shares the stdout pipe (2>&1) */
+    cli_stdin_mode_t     stdin_mode;
+} cli_spawn_opts_t;
+
+/* Interactive session API - Callback delivery modes */
+typedef enum
+{
+    CLI_DELIVERY_INLINE = 0,  /* callbacks run on the session I/O thread (default) */
+    CLI_DELIVERY_RING,        /* callbacks run on the thread calling cli_session_dispatch() */
+    CLI_DELIVERY_PULL         /* no session thread, output read through cli_session_read() */
+} cli_delivery_t;
+
+/* Interactive session API - Behaviour of the I/O thread when the ring is full */
+typedef enum
+{
+    CLI_RING_BLOCK = 0,       /* wait until the consumer releases a slot */
+    CLI_RING_DROP,            /* discard the chunk (counted in the stats) */
+    CLI_RING_GROW             /* link a new ring segment twice as large */
+} cli_ring_policy_t;
+
+/* Interactive session API - Ring configuration (CLI_DELIVERY_RING) */
+typedef struct
+{
+    size_t            slots;      /* number of slots, rounded up to a power of 2 (0 = 64) */
+    size_t            slot_size;  /* bytes per pooled slot buffer (0 = 8192) */
+    cli_ring_policy_t policy;     /* full ring policy */
+} cli_ring_opts_t;
+
+/* Interactive session API - Ring occupancy metrics */
+typedef struct
+{
+    size_t   capacity;        /* slots currently allocated (all segments) */
+    size_t   occupancy;       /* slots holding chunks not yet dispatched */
+    size_t   high_watermark;  /* highest occupancy observed */
+    uint64_t pushed;          /* chunks queued by the I/O thread */
+    uint64_t popped;          /* chunks dispatched to the callbacks */
+    uint64_t dropped;         /* chunks discarded (CLI_RING_DROP) */
+    uint64_t dropped_bytes;   /* bytes discarded (CLI_RING_DROP) */
+    uint64_t stalls;          /* times the I/O thread waited on a full ring */
+    uint64_t grows;           /* segments added (CLI_RING_GROW) */
+} cli_ring_stats_t;
+
+/* Interactive session API - Expect patterns (CLI_DELIVERY_PULL) */
+typedef enum
+{
+    CLI_EXPECT_LITERAL = 0,   /* exact byte sequence */
+    CLI_EXPECT_REGEX          /* POSIX extended regular expression, ^ and $ match at newlines */
+} cli_expect_kind_t;
+
+typedef struct
+{
+    const char       *pattern;
+    cli_expect_kind_t kind;
+    int               stream; /* CLI_STREAM_STDOUT, CLI_STREAM_STDERR or CLI_STREAM_ANY */
+} cli_pattern_t;
+
+typedef struct
+{
+    int     index;            /* index of the matched pattern */
+    int     stream;           /* stream where the match was found */
+    char   *data;             /* consumed output, up to and including the match (malloc'd) */
+    size_t  len;
+    size_t  match_off;        /* offset of the match inside data */
+    size_t  match_len;
+} cli_expect_result_t;
+
+/* Supervisor API - Manages background (daemon) processes */
+typedef struct cli_supervisor cli_supervisor_t;
+
+typedef enum
+{
+    CLI_RESTART_NEVER = 0,    /* never restart */
+    CLI_RESTART_ON_FAILURE,   /* restart when the exit code is not 0 */
+    CLI_RESTART_ALWAYS        /* restart whatever the exit code */
+} cli_restart_t;
+
+typedef enum
+{
+    CLI_DAEMON_STARTING = 0,  /* running, readiness pattern not seen yet */
+    CLI_DAEMON_READY,         /* running (and ready, if a probe is set) */
+    CLI_DAEMON_BACKOFF,       /* exited, waiting to be restarted */
+    CLI_DAEMON_STOPPING,      /* stop signal sent, waiting for exit */
+    CLI_DAEMON_STOPPED        /* exited, will not be restarted */
+} cli_daemon_state_t;
+
+typedef void (*cli_daemon_on_output)(cli_supervisor_t *sup, int id, int stream,
+                                     const char *buf, size_t n, void *user);
+/* on_state is called from the event thread, starting with the state of the first spawn */
+typedef void (*cli_daemon_on_state)(cli_supervisor_t *sup, int id,
+                                    cli_daemon_state_t state, int exit_code, void *user);
+
+typedef struct
+{
+    const char          *cmd;              /* executable name (searched via PATH) */
+    char *const         *argv;             /* argv array, copied (argv[0] should be cmd) */
+    cli_restart_t        restart;          /* restart policy */
+    int                  max_restarts;     /* <0 = unlimited (restarts failing to spawn count too) */
+    int                  backoff_min_ms;   /* first restart delay, doubled at each failure (0 = 100) */
+    int                  backoff_max_ms;   /* restart delay cap (0 = 30000) */
+    int                  stop_signal;      /* graceful stop signal (0 = SIGTERM) */
+    int                  stop_timeout_ms;  /* escalation to SIGKILL after (0 = 5000) */
+    const char          *stdout_path;      /* append stdout to this file (NULL = none) */
+    const char          *stderr_path;      /* append stderr to this file (NULL = none) */
+    cli_daemon_on_output on_output;        /* output callback (NULL = none) */
+    cli_daemon_on_state  on_state;         /* state change callback (NULL = none) */
+    const char          *ready_pattern;    /* literal marking readiness on stdout (NULL = ready at spawn) */
+    int                  ready_timeout_ms; /* restart if not ready within (0 = no limit) */
+    void                *user;
+} cli_daemon_opts_t;
+
+typedef struct
+{
+    cli_daemon_state_t state;
+    pid_t              pid;            /* 0 when not running */
+    unsigned           restarts;       /* restarts performed so far */
+    int64_t            uptime_ms;      /* age of the current instance (0 when not running) */
+    int64_t            total_uptime_ms;/* sum over all instances */
+    int                last_exit_code; /* exit status or 128+signal, -1 if never exited */
+} cli_daemon_status_t;
+
 
 /***********************
  * Function Prototypes *
@@ -101,17 +299,127 @@ int run_oneshot(const char *cmd,
                 int timeout_ms,
                 oneshot_result_t *res_out);
 
+/* One-shot execution API - As run_oneshot(), with spawn options
+   (one-shots accept CLI_FD_INHERIT descriptors only, see
+   cli_shm_create() to share memory with the child). With
+   merge_stderr the interleaved output is returned in out, and err
+   stays empty; a stdin_payload requires CLI_STDIN_PIPE */
+int run_oneshot_ex(const char *cmd,
+                   char *const argv[],
+                   const void *stdin_payload,
+                   size_t stdin_len,
+                   int timeout_ms,
+                   const cli_spawn_opts_t *opts,
+                   oneshot_result_t *res_out);
+
+/* One-shot execution API - Start a command without waiting for it
+   Same parameters as run_oneshot(); stdin_payload must stay valid
+   until the job is finished or cancelled.
+   Returns the job, or NULL on error (errno set) */
+oneshot_job_t *oneshot_job_start(const char *cmd,
+                                 char *const argv[],
+                                 const void *stdin_payload,
+                                 size_t stdin_len);
+
+/* One-shot execution API - As oneshot_job_start(), with spawn options */
+/* (CLI_FD_INHERIT descriptors only)                                   */
+oneshot_job_t *oneshot_job_start_ex(const char *cmd,
+                                    char *const argv[],
+                                    const void *stdin_payload,
+                                    size_t stdin_len,
+                                    const cli_spawn_opts_t *opts);
+
+/* One-shot execution API - Descriptors the job is waiting on
+   Fills at most max entries of pfds (3 are always enough) and
+   returns their number. Once the output is at EOF, the child exit
+   is waited on through a pidfd (Linux 5.3+); where pidfds are not
+   available no descriptor is returned until the job is complete,
+   and oneshot_job_step() should be retried periodically (10 ms) */
+int oneshot_job_pollfds(oneshot_job_t *j, struct pollfd *pfds, int max);
+
+/* One-shot execution API - Make progress without blocking
+   Writes as much of the stdin payload and reads as much output as
+   currently possible.
+   Returns 1 once stdout and stderr are at EOF and the child has been
+   reaped, 0 if the job would block (wait on oneshot_job_pollfds()),
+   -1 on error (errno set) */
+int oneshot_job_step(oneshot_job_t *j);
+
+/* One-shot execution API - Move the exit code and output of a completed
+   job (oneshot_job_step() returned 1) into res_out (buffers owned by
+   caller) and free the job. Never blocks.
+   Returns 0 on success, -1 on error (errno set, EBUSY if the job is
+   not complete: it is left untouched) */
+int oneshot_job_finish(oneshot_job_t *j, oneshot_result_t *res_out);
+
+/* One-shot execution API - Kill the child of a job (SIGKILL), reap it */
+/* and release all job resources                                      */
+void oneshot_job_cancel(oneshot_job_t *j);
+
 
 /* Interactive session API - Create an interactive CLI session */
 /* Returns the pointer to the newly created session            */
 cli_session_t *cli_session_create(void);
 
+/* Interactive session API - Select how callbacks are delivered
+   - mode == CLI_DELIVERY_INLINE --> callbacks are invoked by the
+                                     session thread (default)
+   - mode == CLI_DELIVERY_RING   --> the session thread pushes output
+                                     chunks into a lock-free single
+                                     producer/single consumer ring of
+                                     pooled buffers, and callbacks are
+                                     invoked by cli_session_dispatch()
+   - mode == CLI_DELIVERY_PULL   --> no session thread is created, the
+                                     caller reads output on its own
+                                     thread with cli_session_read() (or
+                                     polls the descriptors returned by
+                                     cli_session_fd()); on_stdout and
+                                     on_stderr are not used
+   - ring  optional ring configuration (NULL = defaults)
+   Must be called before cli_session_start() or after
+   cli_session_join()
+   Returns 0 on success, -1 on error (errno set, EBUSY while the
+   session is started) */
+int cli_session_set_delivery(cli_session_t *s,
+                             cli_delivery_t mode,
+                             const cli_ring_opts_t *ring);
+
+/* Interactive session API - Set spawn options (copied)
+   Extra channels are created at each cli_session_start(); the parent
+   end of a channel is returned by cli_session_fd(s, child_fd), the
+   parent mapping of a CLI_FD_MEMFD region by cli_session_shm().
+   Output of CLI_FD_PIPE_OUT/CLI_FD_SOCKETPAIR channels goes to
+   on_channel (inline or ring delivery), or to cli_session_read() in
+   pull mode. With merge_stderr, stderr is delivered as stdout, in
+   the order it was written.
+   Must be called before cli_session_start() or after
+   cli_session_join()
+   Returns 0 on success, -1 on error (errno set, EBUSY while the
+   session is started) */
+int cli_session_set_spawn_opts(cli_session_t *s, const cli_spawn_opts_t *opts);
+
+/* Interactive session API - Coalesce output before callbacks
+   - min_bytes     the output of a stream is held until at least
+                   min_bytes are available (0 = disabled, each read
+                   is delivered as is)...
+   - max_delay_us  ...or until its oldest byte has been held for
+                   max_delay_us microseconds, whichever comes first
+   Held output is delivered at once at the end of its stream and when
+   the session stops. Applies to inline and ring delivery (ring slots
+   still split chunks larger than slot_size), not to pull mode.
+   Must be called before cli_session_start() or after
+   cli_session_join()
+   Returns 0 on success, -1 on error (errno set, EBUSY while the
+   session is started) */
+int cli_session_set_coalesce(cli_session_t *s, size_t min_bytes, unsigned max_delay_us);
+
 /* Interactive session API - Start an interactive CLI session */
 /* Forks the process and launches the command cmd with its    */
 /* arguments argv[] in the child. It returns only in the      */
 /* parent, where it creates a thread which monitors the child */
 /* and handles callback functions. It returns the result of   */
-/* pthread_create(), i.e. 0 on success                        */
+/* pthread_create(), i.e. 0 on success (CLI_DELIVERY_PULL     */
+/* sessions create no thread and return 0)                    */
 int cli_session_start(cli_session_t *s,
                       const char *cmd,
                       char *const argv[],
@@ -135,7 +443,84 @@ void cli_session_close_stdin(cli_session_t *s);
                   send signal sig to child */
 int cli_session_stop(cli_session_t *s, int sig);
 
+/* Interactive session API - Dispatch queued output (CLI_DELIVERY_RING)
+   Invokes on_stdout/on_stderr on the calling thread for every chunk
+   queued in the ring, waiting up to timeout_ms (<0 = infinite) for
+   the first one. Once the child has exited and the ring is drained,
+   on_exit is invoked exactly once.
+   Returns the number of callbacks invoked (0 on timeout), or -1 with
+   errno == EPIPE when nothing else will ever be delivered */
+int cli_session_dispatch(cli_session_t *s, int timeout_ms);
+
+/* Interactive session API - Read ring occupancy metrics */
+/* Returns 0 on success, -1 on error (errno set)         */
+int cli_session_ring_stats(cli_session_t *s, cli_ring_stats_t *st);
+
+/* Interactive session API - Read child output (CLI_DELIVERY_PULL)
+   - stream      CLI_STREAM_STDOUT, CLI_STREAM_STDERR or the child_fd
+                 of a CLI_FD_PIPE_OUT/CLI_FD_SOCKETPAIR channel
+   - buf, n      caller buffer, filled directly by read()
+   - timeout_ms  <0 = infinite, 0 = do not wait
+   Output already buffered by cli_session_expect() is returned first.
+   Returns bytes read, 0 at end of stream, or -1 on error
+   (errno == ETIMEDOUT when no data arrived in time) */
+ssize_t cli_session_read(cli_session_t *s,
+                         int stream,
+                         void *buf,
+                         size_t n,
+                         int timeout_ms);
+
+/* Interactive session API - Wait for one of several patterns in the output
+   (CLI_DELIVERY_PULL)
+   - patterns    array of npatterns literal or regex patterns
+   - timeout_ms  <0 = infinite
+   - res         optional result (buffer owned by caller)
+   Output is scanned incrementally as it is read, so matches split across
+   reads are found; while waiting, only the last lookback window bytes of
+   each stream are retained (see cli_session_set_expect_window()). Output
+   following the match stays buffered for the next cli_session_expect() or
+   cli_session_read().
+   Returns the index of the matched pattern, or -1 on error (errno ==
+   ETIMEDOUT on timeout, EPIPE if the watched streams reached EOF) */
+int cli_session_expect(cli_session_t *s,
+                       const cli_pattern_t *patterns,
+                       size_t npatterns,
+                       int timeout_ms,
+                       cli_expect_result_t *res);
+
+/* Interactive session API - Free buffers inside cli_expect_result_t */
+void cli_expect_result_free(cli_expect_result_t *r);
+
+/* Interactive session API - Set the cli_session_expect() lookback window */
+/* in bytes per stream (0 = 65536). Returns 0 on success, -1 on error     */
+int cli_session_set_expect_window(cli_session_t *s, size_t bytes);
+
+/* Interactive session API - Parent side descriptor of a child stream */
+/* or extra channel (stream == child_fd), owned by the session and    */
+/* suitable for the caller's own poll()/epoll() loop (stdio and       */
+/* channel pipes are non-blocking). Returns -1 if the stream is closed */
+int cli_session_fd(cli_session_t *s, int stream);
+
+/* Interactive session API - Parent mapping of a CLI_FD_MEMFD channel */
+/* Returns its address (and size, if not NULL), or NULL on error      */
+void *cli_session_shm(cli_session_t *s, int child_fd, size_t *size);
+
+/* Shared memory - Create an anonymous shared memory region (memfd)
+   of size bytes, mapped read/write at *addr. The descriptor can be
+   given to children (CLI_FD_INHERIT), which map it on their side.
+   Release with munmap(*addr, size) and close().
+   Returns the descriptor (close-on-exec), or -1 on error (errno set) */
+int cli_shm_create(const char *name, size_t size, void **addr);
+
+/* Interactive session API - User pointer given in cli_callbacks_t */
+void *cli_session_user(cli_session_t *s);
+
+/* Interactive session API - Exit code of the child once reaped */
+/* (exit status or 128+signal). Returns -1 if not yet available */
+int cli_session_exit_code(cli_session_t *s);
+
 /* Interactive session API - Wait for session thread to exit */
+/* (CLI_DELIVERY_PULL: wait for the child and invoke on_exit) */
 int cli_session_join(cli_session_t *s);
 
 /* Interactive session API - Destroys an interactive CLI session */
@@ -143,6 +528,55 @@ int cli_session_join(cli_session_t *s);
 void cli_session_destroy(cli_session_t *s);
 
 
+/* Supervisor API - Create a supervisor and start its event thread   */
+/* A single thread monitors every daemon through pidfds (Linux 5.3+) */
+/* and drains their output. Returns NULL on error (errno set)        */
+cli_supervisor_t *cli_supervisor_create(void);
+
+/* Supervisor API - Start a detached daemon (own session, stdin from
+   /dev/null) managed with the given options.
+   Returns the daemon id (>= 0), or -1 on error (errno set) */
+int cli_supervisor_add(cli_supervisor_t *sup, const cli_daemon_opts_t *opts);
+
+/* Supervisor API - Stop a daemon gracefully: stop_signal, then SIGKILL */
+/* after stop_timeout_ms. Asynchronous: the state becomes               */
+/* CLI_DAEMON_STOPPED once the daemon has exited                        */
+int cli_supervisor_stop(cli_supervisor_t *sup, int id);
+
+/* Supervisor API - Read state, restart count and uptime of a daemon */
+/* Returns 0 on success, -1 on error (errno set)                     */
+int cli_supervisor_status(cli_supervisor_t *sup, int id, cli_daemon_status_t *st);
+
+/* Supervisor API - Stop all daemons (as cli_supervisor_stop()), wait */
+/* for them and for the event thread, release all resources           */
+void cli_supervisor_destroy(cli_supervisor_t *sup);
+
+
+/* Trace recorder - Create (truncate) a trace file
+   - flags  0 or CLI_TRACE_PAYLOAD
+   Records are buffered in memory and written in large blocks; the
+   recorder is thread safe and can be given to any number of sessions
+   and one-shots through cli_spawn_opts_t.trace.
+   Returns the recorder, or NULL on error (errno set) */
+cli_trace_t *cli_trace_open(const char *path, unsigned flags);
+
+/* Trace recorder - Write buffered records to the file */
+/* Returns 0 on success, -1 on error (errno set)       */
+int cli_trace_flush(cli_trace_t *t);
+
+/* Trace recorder - Flush and close the trace file. The recorder must no
+   longer be in use by any session or one-shot.
+   Returns 0 on success, -1 if any record could not be written (errno set) */
+int cli_trace_close(cli_trace_t *t);
+
+/* Trace replay - Read a trace file and invoke cb for each record, in
+   recording order (e.g. to feed recorded CLI_TRACE_READ payloads to
+   on_stdout callbacks for offline benchmarking).
+   Returns the number of records, or -1 on error (errno set, EINVAL
+   for a file that is not a trace) */
+long cli_trace_replay(const char *path, cli_trace_on_record cb, void *user);
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,725 @@
+/**********************************************************************************/
+/*  ---------------------------------------                                       */
+/*  C/C++ CLI Runner Library (libclirunner)                                       */
+/*  ---------------------------------------                                       */
+/*  Copyright 2026 Roberto Mameli                                                 */
+/*                                                                                */
+/*  Licensed under the Apache License, Version 2.0 (the "License");               */
+/*  you may not use this file except in compliance with the License.              */
+/*  You may obtain a copy of the License at                                       */
+/*                                                                                */
+/*      http://www.apache.org/licenses/LICENSE-2.0                                */
+/*                                                                                */
+/*  Unless required by applicable law or agreed to in writing, software           */
+/*  distributed under the License is distributed on an "AS IS" BASIS,             */
+/*  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.      */
+/*  See the License for the specific language governing permissions and           */
+/*  limitations under the License.                                                */
+/*  ------------------------------------------------------------------------      */
+/*                                                                                */
+/*  FILE:        libclirunner C++20 header-only wrapper                           */
+/*  VERSION:     1.0.0                                                            */
+/*  AUTHOR(S):   Roberto Mameli                                                   */
+/*  PRODUCT:     Library libclirunner                                             */
+/*  DESCRIPTION: RAII, move-only wrappers and coroutine awaitables on top of the  */
+/*               libclirunner C API                                               */
+/*  REV HISTORY: See updated Revision History in file CHANGELOG.md                */
+/*  NOTE WELL:   If a C++ application needs services and functions from this      */
+/*               API, it MUST necessarily:                                        */
+/*               - include the library header file                                */
+/*                    #include "clirunner.hpp"                                    */
+/*               - be compiled with -std=c++20 (or later)                         */
+/*               - be linked by including either the shared or the static         */
+/*                 library libclirunner                                           */
+/**********************************************************************************/
+
+#ifndef CLIRUNNER_HPP
+#define CLIRUNNER_HPP
+
+
+/*****************
+ * Include Files *
+ *****************/
+#include "clirunner.h"
+
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace clirunner
+{
+
+/********************
+ * Helper Functions *
+ ********************/
+[[noreturn]] inline void throw_errno(const char *what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+
+/********************
+ * Type Definitions *
+ ********************/
+/* Child streams */
+enum class Stream : int
+{
+    Stdin  = CLI_STREAM_STDIN,
+    Stdout = CLI_STREAM_STDOUT,
+    Stderr = CLI_STREAM_STDERR
+};
+
+/* Session callback delivery (see cli_session_set_delivery()) */
+enum class Delivery : int
+{
+    Inline = CLI_DELIVERY_INLINE,
+    Ring   = CLI_DELIVERY_RING,
+    Pull   = CLI_DELIVERY_PULL
+};
+
+/* Null-terminated argv built from a list of arguments; args[0] is */
+/* the command. Strings are referenced, not copied                 */
+class Argv
+{
+public:
+    Argv(std::initializer_list<const char *> args) : v_(args)
+    {
+        v_.push_back(nullptr);
+    }
+
+    Argv(const std::vector<std::string> &args)
+    {
+        v_.reserve(args.size() + 1);
+        for (const auto &a : args)
+            v_.push_back(a.c_str());
+        v_.push_back(nullptr);
+    }
+
+    const char  *cmd() const noexcept { return v_.front(); }
+    char *const *get() const noexcept { return const_cast<char *const *>(v_.data()); }
+
+private:
+    std::vector<const char *> v_;
+};
+
+/* Move-only callable with inline storage: lambdas are stored inside */
+/* the object, never on the heap (too large captures do not compile) */
+template <class Sig, std::size_t Capacity = 6 * sizeof(void *)>
+class InlineFunction;
+
+template <class R, class... A, std::size_t Capacity>
+class InlineFunction<R(A...), Capacity>
+{
+public:
+    InlineFunction() noexcept = default;
+
+    template <class F, class D = std::decay_t<F>,
+              class = std::enable_if_t<!std::is_same_v<D, InlineFunction>>>
+    InlineFunction(F &&f)
+    {
+        static_assert(sizeof(D) <= Capacity,
+                      "callable too large for InlineFunction, capture a pointer instead");
+        static_assert(alignof(D) <= alignof(std::max_align_t),
+                      "callable over-aligned for InlineFunction");
+        static_assert(std::is_nothrow_move_constructible_v<D>,
+                      "callable must be nothrow move constructible");
+
+        ::new (static_cast<void *>(buf_)) D(std::forward<F>(f));
+        call_ = [](void *p, A... a) -> R { return (*static_cast<D *>(p))(std::forward<A>(a)...); };
+        move_ = [](void *dst, void *src) noexcept
+        {
+            if (dst)
+                ::new (dst) D(std::move(*static_cast<D *>(src)));
+            static_cast<D *>(src)->~D();
+        };
+    }
+
+    InlineFunction(InlineFunction &&o) noexcept { take(o); }
+
+    InlineFunction &operator=(InlineFunction &&o) noexcept
+    {
+        if (this != &o)
+        {
+            reset();
+            take(o);
+        }
+        return *this;
+    }
+
+    InlineFunction(const InlineFunction &) = delete;
+    InlineFunction &operator=(const InlineFunction &) = delete;
+
+    ~InlineFunction() { reset(); }
+
+    void reset() noexcept
+    {
+        if (move_)
+            move_(nullptr, buf_);
+        call_ = nullptr;
+        move_ = nullptr;
+    }
+
+    explicit operator bool() const noexcept { return call_ != nullptr; }
+
+    R operator()(A... a) { return call_(buf_, std::forward<A>(a)...); }
+
+private:
+    void take(InlineFunction &o) noexcept
+    {
+        if (!o.move_)
+            return;
+        o.move_(buf_, o.buf_);
+        call_ = o.call_;
+        move_ = o.move_;
+        o.call_ = nullptr;
+        o.move_ = nullptr;
+    }
+
+    alignas(std::max_align_t) unsigned char buf_[Capacity];
+    R    (*call_)(void *, A...) = nullptr;
+    void (*move_)(void *, void *) noexcept = nullptr;
+};
+
+/* One-shot result owning its output buffers */
+class Result
+{
+public:
+    Result() noexcept : r_{} {}
+    explicit Result(const oneshot_result_t &r) noexcept : r_(r) {}
+
+    Result(Result &&o) noexcept : r_(o.r_) { o.r_ = {}; }
+
+    Result &operator=(Result &&o) noexcept
+    {
+        if (this != &o)
+        {
+            oneshot_result_free(&r_);
+            r_ = o.r_;
+            o.r_ = {};
+        }
+        return *this;
+    }
+
+    Result(const Result &) = delete;
+    Result &operator=(const Result &) = delete;
+
+    ~Result() { oneshot_result_free(&r_); }
+
+    int              exit_code() const noexcept { return r_.exit_code; }
+    std::string_view out() const noexcept { return { r_.out ? r_.out : "", r_.out_len }; }
+    std::string_view err() const noexcept { return { r_.err ? r_.err : "", r_.err_len }; }
+
+private:
+    oneshot_result_t r_;
+};
+
+/* cli_session_expect() result owning the consumed output */
+class Match
+{
+public:
+    Match() noexcept : r_{} {}
+    explicit Match(const cli_expect_result_t &r) noexcept : r_(r) {}
+
+    Match(Match &&o) noexcept : r_(o.r_) { o.r_ = {}; }
+
+    Match &operator=(Match &&o) noexcept
+    {
+        if (this != &o)
+        {
+            cli_expect_result_free(&r_);
+            r_ = o.r_;
+            o.r_ = {};
+        }
+        return *this;
+    }
+
+    Match(const Match &) = delete;
+    Match &operator=(const Match &) = delete;
+
+    ~Match() { cli_expect_result_free(&r_); }
+
+    int              index() const noexcept { return r_.index; }
+    Stream           stream() const noexcept { return static_cast<Stream>(r_.stream); }
+    std::string_view data() const noexcept { return { r_.data ? r_.data : "", r_.len }; }
+    std::string_view match() const noexcept { return data().substr(r_.match_off, r_.match_len); }
+
+private:
+    cli_expect_result_t r_;
+};
+
+
+/****************************
+ * Coroutine Event Loop     *
+ ****************************/
+/* Minimal poll() reactor: each pending awaitable is an intrusive Op  */
+/* living in the awaiting coroutine frame, so waiting allocates       */
+/* nothing. A single thread can drive any number of children          */
+class Loop
+{
+public:
+    struct Op
+    {
+        int  (*fill)(Op *, struct pollfd *, int max);             /* descriptors to wait on */
+        bool (*ready)(Op *);                                     /* true when complete */
+        std::coroutine_handle<> h;
+        Op  *next = nullptr;
+        std::int64_t wake = -1;     /* set by fill: also check at now_ms() >= wake (-1 = never) */
+    };
+
+    /* Monotonic clock of the wake deadlines, in ms */
+    static std::int64_t now_ms() noexcept
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    Loop() = default;
+    Loop(const Loop &) = delete;
+    Loop &operator=(const Loop &) = delete;
+
+    void add(Op *op) noexcept
+    {
+        op->next = head_;
+        head_ = op;
+    }
+
+    bool empty() const noexcept { return head_ == nullptr; }
+
+    /* Polls once (timeout_ms <0 = infinite) and resumes the coroutines */
+    /* whose operation completed. Returns false when nothing is pending */
+    bool run_once(int timeout_ms = -1)
+    {
+        /* Local Variables */
+        std::vector<std::coroutine_handle<>> resume;
+        Op                                 **pp;
+        std::size_t                          i;
+        std::int64_t                         wake = -1,
+                                             now;
+        int                                  n;
+
+        if (!head_)
+            return false;
+
+        pfds_.clear();
+        counts_.clear();
+        for (Op *op = head_; op; op = op->next)
+        {
+            op->wake = -1;
+            pfds_.resize(pfds_.size() + 3);
+            n = op->fill(op, pfds_.data() + pfds_.size() - 3, 3);
+            pfds_.resize(pfds_.size() - 3 + n);
+            counts_.push_back(n);
+
+            /* An Op without descriptors nor deadline is complete already */
+            if (!n && op->wake < 0)
+                wake = 0;
+            else if (op->wake >= 0 && (wake < 0 || op->wake < wake))
+                wake = op->wake;
+        }
+
+        if (wake >= 0)
+        {
+            now = now_ms();
+            if (timeout_ms < 0 || wake - now < timeout_ms)
+                timeout_ms = (wake > now) ? static_cast<int>(wake - now) : 0;
+        }
+
+        if (::poll(pfds_.data(), pfds_.size(), timeout_ms) < 0 && errno != EINTR)
+            throw_errno("poll");
+
+        now = now_ms();
+        std::size_t first = 0;
+        i = 0;
+        for (pp = &head_; *pp; i++)
+        {
+            Op  *op = *pp;
+            bool fired = (counts_[i] == 0 && op->wake < 0) || (op->wake >= 0 && now >= op->wake);
+
+            for (int k = 0; k < counts_[i]; k++)
+                fired |= pfds_[first + k].revents != 0;
+            first += counts_[i];
+
+            if (fired && op->ready(op))
+            {
+                *pp = op->next;
+                resume.push_back(op->h);
+            }
+            else
+                pp = &op->next;
+        }
+
+        for (auto h : resume)
+            h.resume();
+
+        return head_ != nullptr;
+    }
+
+    void run()
+    {
+        while (run_once())
+            ;
+    }
+
+private:
+    Op                 *head_ = nullptr;
+    std::vector<pollfd> pfds_;
+    std::vector<int>    counts_;
+};
+
+/* Fire-and-forget coroutine type, for callers without a task type of */
+/* their own. Unhandled exceptions terminate the program              */
+struct Detached
+{
+    struct promise_type
+    {
+        Detached            get_return_object() noexcept { return {}; }
+        std::suspend_never  initial_suspend() noexcept { return {}; }
+        std::suspend_never  final_suspend() noexcept { return {}; }
+        void                return_void() noexcept {}
+        void                unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+/* co_await async_run(loop, args, input, timeout_ms) --> Result        */
+/* The child is spawned when awaited; input must outlive the co_await. */
+/* After timeout_ms (<0 = infinite) the child is killed (SIGKILL) and  */
+/* std::system_error (ETIMEDOUT) is thrown                             */
+class RunAwaiter : private Loop::Op
+{
+public:
+    RunAwaiter(Loop &loop, Argv args, std::string_view input, int timeout_ms = -1)
+        : loop_(loop), args_(std::move(args)), input_(input), timeout_ms_(timeout_ms)
+    {
+        fill = [](Op *o, struct pollfd *p, int max)
+        {
+            auto *a = static_cast<RunAwaiter *>(o);
+            int   n = oneshot_job_pollfds(a->job_, p, max);
+
+            /* No pidfd to wait for the child exit on: check it periodically */
+            a->wake = a->deadline_;
+            if (!n && (a->wake < 0 || a->wake > Loop::now_ms() + 10))
+                a->wake = Loop::now_ms() + 10;
+            return n;
+        };
+        ready = [](Op *o) { return static_cast<RunAwaiter *>(o)->step(); };
+    }
+
+    RunAwaiter(const RunAwaiter &) = delete;
+    RunAwaiter &operator=(const RunAwaiter &) = delete;
+
+    ~RunAwaiter()
+    {
+        if (job_)
+            oneshot_job_cancel(job_);
+    }
+
+    bool await_ready()
+    {
+        job_ = oneshot_job_start(args_.cmd(), args_.get(), input_.data(), input_.size());
+        if (!job_)
+            throw_errno("oneshot_job_start");
+        deadline_ = (timeout_ms_ >= 0) ? Loop::now_ms() + timeout_ms_ : -1;
+        return step();
+    }
+
+    void await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        this->h = h;
+        loop_.add(this);
+    }
+
+    Result await_resume()
+    {
+        /* Local Variables */
+        oneshot_result_t r;
+
+        if (err_)
+        {
+            errno = err_;
+            throw_errno("oneshot_job_step");
+        }
+        /* The job is complete (child reaped): this does not block */
+        if (oneshot_job_finish(job_, &r) < 0)
+            throw_errno("oneshot_job_finish");
+        job_ = nullptr;
+
+        return Result(r);
+    }
+
+private:
+    bool step() noexcept
+    {
+        int r = oneshot_job_step(job_);
+
+        if (r < 0)
+            err_ = errno;
+        else if (r == 0 && deadline_ >= 0 && Loop::now_ms() >= deadline_)
+        {
+            oneshot_job_cancel(job_);
+            job_ = nullptr;
+            err_ = ETIMEDOUT;
+            return true;
+        }
+        return r != 0;
+    }
+
+    Loop            &loop_;
+    Argv             args_;
+    std::string_view input_;
+    int              timeout_ms_;
+    std::int64_t     deadline_ = -1;
+    oneshot_job_t   *job_ = nullptr;
+    int              err_ = 0;
+};
+
+inline RunAwaiter async_run(Loop &loop, Argv args, std::string_view input = {}, int timeout_ms = -1)
+{
+    return RunAwaiter(loop, std::move(args), input, timeout_ms);
+}
+
+/* Synchronous one-shot execution (see run_oneshot()) */
+inline Result run(const Argv &args, std::string_view input = {}, int timeout_ms = -1)
+{
+    /* Local Variables */
+    oneshot_result_t r;
+
+    if (run_oneshot(args.cmd(), args.get(), input.data(), input.size(), timeout_ms, &r) < 0)
+        throw_errno("run_oneshot");
+
+    return Result(r);
+}
+
+/* co_await session.async_read(loop, stream, buf) --> std::string_view */
+/* into buf (empty at end of stream). Pull mode sessions only          */
+class ReadAwaiter : private Loop::Op
+{
+public:
+    ReadAwaiter(Loop &loop, cli_session_t *s, Stream stream, std::span<char> buf)
+        : loop_(loop), s_(s), stream_(static_cast<int>(stream)), buf_(buf)
+    {
+        fill = [](Op *o, struct pollfd *p, int max)
+        {
+            auto *a = static_cast<ReadAwaiter *>(o);
+            int   fd = cli_session_fd(a->s_, a->stream_);
+
+            if (fd < 0 || max < 1)
+                return 0;
+            p[0] = { fd, POLLIN, 0 };
+            return 1;
+        };
+        ready = [](Op *o) { return static_cast<ReadAwaiter *>(o)->try_read(); };
+    }
+
+    ReadAwaiter(const ReadAwaiter &) = delete;
+    ReadAwaiter &operator=(const ReadAwaiter &) = delete;
+
+    bool await_ready() noexcept { return try_read(); }
+
+    void await_suspend(std::coroutine_handle<> h) noexcept
+    {
+        this->h = h;
+        loop_.add(this);
+    }
+
+    std::string_view await_resume()
+    {
+        if (err_)
+        {
+            errno = err_;
+            throw_errno("cli_session_read");
+        }
+        return { buf_.data(), static_cast<std::size_t>(n_) };
+    }
+
+private:
+    bool try_read() noexcept
+    {
+        n_ = cli_session_read(s_, stream_, buf_.data(), buf_.size(), 0);
+        if (n_ >= 0)
+            return true;
+        if (errno == ETIMEDOUT)
+            return false;
+        err_ = errno;
+        return true;
+    }
+
+    Loop           &loop_;
+    cli_session_t  *s_;
+    int             stream_;
+    std::span<char> buf_;
+    ssize_t         n_ = 0;
+    int             err_ = 0;
+};
+
+/* Move-only interactive session. Destroying a session whose child is */
+/* still running kills it (SIGKILL) and joins it                      */
+class Session
+{
+public:
+    using OutputHandler = InlineFunction<void(std::string_view)>;
+    using ExitHandler   = InlineFunction<void(int)>;
+
+    explicit Session(Delivery mode = Delivery::Inline, const cli_ring_opts_t *ring = nullptr)
+        : st_(std::make_unique<State>())
+    {
+        st_->s = cli_session_create();
+        if (!st_->s)
+            throw std::bad_alloc();
+        if (cli_session_set_delivery(st_->s, static_cast<cli_delivery_t>(mode), ring) < 0)
+            throw_errno("cli_session_set_delivery");
+    }
+
+    Session(Session &&) noexcept = default;
+    Session &operator=(Session &&) noexcept = default;
+
+    /* Handlers, to be set before start() */
+    Session &on_stdout(OutputHandler f) noexcept { st_->out = std::move(f); return *this; }
+    Session &on_stderr(OutputHandler f) noexcept { st_->err = std::move(f); return *this; }
+    Session &on_exit(ExitHandler f) noexcept     { st_->exit = std::move(f); return *this; }
+
+    void start(const Argv &args)
+    {
+        /* Local Variables */
+        cli_callbacks_t cb = { &State::out_cb, &State::err_cb, &State::exit_cb, st_.get() };
+        int             rc;
+
+        rc = cli_session_start(st_->s, args.cmd(), args.get(), &cb);
+        if (rc != 0)
+        {
+            if (rc > 0)
+                errno = rc;     /* pthread_create() error */
+            throw_errno("cli_session_start");
+        }
+        st_->started = true;
+    }
+
+    std::size_t write(std::string_view data)
+    {
+        ssize_t n = cli_session_write_stdin(st_->s, data.data(), data.size());
+
+        if (n < 0)
+            throw_errno("cli_session_write_stdin");
+        return static_cast<std::size_t>(n);
+    }
+
+    void close_stdin() noexcept { cli_session_close_stdin(st_->s); }
+    void stop(int sig = 0) noexcept { cli_session_stop(st_->s, sig); }
+
+    /* Returns the child exit code */
+    int join()
+    {
+        if (st_->started && !st_->joined)
+        {
+            cli_session_join(st_->s);
+            st_->joined = true;
+        }
+        return cli_session_exit_code(st_->s);
+    }
+
+    /* Ring mode: returns false once nothing else will be delivered */
+    bool dispatch(int timeout_ms = -1)
+    {
+        if (cli_session_dispatch(st_->s, timeout_ms) >= 0)
+            return true;
+        if (errno != EPIPE)
+            throw_errno("cli_session_dispatch");
+        return false;
+    }
+
+    /* Pull mode: reads into buf, returns the part filled (empty at EOF) */
+    std::string_view read(Stream stream, std::span<char> buf, int timeout_ms = -1)
+    {
+        ssize_t n = cli_session_read(st_->s, static_cast<int>(stream), buf.data(), buf.size(), timeout_ms);
+
+        if (n < 0)
+            throw_errno("cli_session_read");
+        return { buf.data(), static_cast<std::size_t>(n) };
+    }
+
+    /* Pull mode: co_await-able read driven by loop */
+    ReadAwaiter async_read(Loop &loop, Stream stream, std::span<char> buf) noexcept
+    {
+        return ReadAwaiter(loop, st_->s, stream, buf);
+    }
+
+    /* Pull mode: waits for one of the patterns */
+    Match expect(std::span<const cli_pattern_t> patterns, int timeout_ms = -1)
+    {
+        cli_expect_result_t r;
+
+        if (cli_session_expect(st_->s, patterns.data(), patterns.size(), timeout_ms, &r) < 0)
+            throw_errno("cli_session_expect");
+        return Match(r);
+    }
+
+    int            fd(Stream stream) const noexcept { return cli_session_fd(st_->s, static_cast<int>(stream)); }
+    cli_session_t *native_handle() const noexcept { return st_->s; }
+
+private:
+    /* Heap allocated once per session, so that the callbacks user */
+    /* pointer stays valid when the Session object is moved        */
+    struct State
+    {
+        cli_session_t *s = nullptr;
+        OutputHandler  out;
+        OutputHandler  err;
+        ExitHandler    exit;
+        bool           started = false;
+        bool           joined = false;
+
+        ~State()
+        {
+            if (!s)
+                return;
+            if (started && !joined)
+            {
+                if (cli_session_exit_code(s) < 0)
+                    cli_session_stop(s, SIGKILL);
+                cli_session_join(s);
+            }
+            cli_session_destroy(s);
+        }
+
+        static void out_cb(cli_session_t *s, const char *buf, size_t n)
+        {
+            auto *st = static_cast<State *>(cli_session_user(s));
+            if (st->out)
+                st->out(std::string_view(buf, n));
+        }
+
+        static void err_cb(cli_session_t *s, const char *buf, size_t n)
+        {
+            auto *st = static_cast<State *>(cli_session_user(s));
+            if (st->err)
+                st->err(std::string_view(buf, n));
+        }
+
+        static void exit_cb(cli_session_t *s, int code)
+        {
+            auto *st = static_cast<State *>(cli_session_user(s));
+            if (st->exit)
+                st->exit(code);
+        }
+    };
+
+    std::unique_ptr<State> st_;
+};
+
+} /* namespace clirunner */
+
+#endif /* CLIRUNNER_HPP */
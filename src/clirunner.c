@@ -36,12 +36,19 @@
 /*****************
  * Include Files *
  *****************/
+/* pipe2(), ppoll(), memfd_create() and syscall() (pidfd_open) are Linux/GNU */
+/* extensions, each one has a POSIX fallback for the other systems             */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "clirunner.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <pthread.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdatomic.h>
 #include <stdbool.h>
@@ -49,6 +56,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -65,19 +75,171 @@
     size_t cap;
 } dynbuf_t;
 
-/* Type definition for Process Spawning */
+/* Type definitions for the SPSC delivery ring */
 typedef struct
 {
-    int   in_w;
-    int   out_r;
-    int   err_r;
-    pid_t pid;
+    int    stream;      /* CLI_STREAM_STDOUT, CLI_STREAM_STDERR or channel */
+    size_t len;
+    char  *data;        /* points into the segment buffer pool */
+} ring_slot_t;
+
+typedef struct ring_seg
+{
+    size_t                    mask;     /* number of slots - 1 */
+    ring_slot_t              *slots;
+    char                     *pool;
+    _Atomic(struct ring_seg *) next;    /* set by the producer when it moves on (GROW) */
+    _Alignas(64) atomic_size_t head;    /* written only by the producer */
+    _Alignas(64) atomic_size_t tail;    /* written only by the consumer */
+} ring_seg_t;
+
+typedef struct
+{
+    ring_seg_t       *prod;             /* segment filled by the session thread */
+    ring_seg_t       *cons;             /* segment drained by the consumer */
+    size_t            slot_size;
+    cli_ring_policy_t policy;
+    pthread_mutex_t   lock;             /* only used to park a waiting side */
+    pthread_cond_t    not_empty;
+    pthread_cond_t    not_full;
+    atomic_bool       cons_waiting;
+    atomic_bool       prod_waiting;
+    atomic_size_t     capacity;
+    atomic_size_t     high_watermark;
+    atomic_uint_fast64_t pushed,
+                         popped,
+                         dropped,
+                         dropped_bytes,
+                         stalls,
+                         grows;
+} ring_t;
+
+/* Type definition for the cli_session_expect() streaming matcher */
+typedef struct
+{
+    const cli_pattern_t *p;
+    size_t               len;       /* literal length */
+    size_t              *fail;      /* literal KMP failure table */
+    size_t               state[2];  /* literal KMP state, per stream */
+    regex_t              re;
+    bool                 re_ok;
+} matcher_t;
+
+/* Type definition for the Supervisor API */
+typedef struct
+{
+    int                id;
+    char              *cmd;
+    char             **argv;
+    cli_daemon_opts_t  o;             /* copy of the options (strings not retained) */
+    cli_pattern_t      ready_pat;
+    matcher_t         *ready;         /* readiness probe, NULL = none */
+    int                file_fd[2];    /* stdout/stderr files, -1 = none */
+    /* Event thread only */
+    int                out_fd[2];     /* pipe read ends, -1 = closed */
+    int                pidfd;         /* -1 = not available, fall back to waitpid() polling */
+    int                backoff_ms;    /* next restart delay */
+    unsigned           failed_spawns; /* restarts that could not spawn (count for max_restarts) */
+    int64_t            restart_at;    /* CLI_DAEMON_BACKOFF deadline */
+    int64_t            kill_at;       /* CLI_DAEMON_STOPPING SIGKILL deadline, 0 = sent */
+    int64_t            ready_at;      /* CLI_DAEMON_STARTING deadline, 0 = none */
+    bool               timed_out;     /* stopped for missing readiness */
+    bool               announced;     /* first state reported to on_state */
+    /* Shared with the API functions, under the supervisor lock */
+    cli_daemon_state_t state;
+    bool               stop_requested;
+    pid_t              pid;
+    unsigned           restarts;
+    int64_t            started_at;
+    int64_t            total_uptime;
+    int                last_exit;
+} daemon_t;
+
+/* Type definitions for Process Spawning */
+typedef struct
+{
+    int           child_fd;
+    cli_fd_kind_t kind;
+    int           fd;           /* parent end, -1 = none or closed */
+    void         *map;          /* CLI_FD_MEMFD parent mapping */
+    size_t        size;
+} channel_t;
+
+typedef struct
+{
+    int        in_w;
+    int        out_r;
+    int        err_r;
+    pid_t      pid;
+    channel_t   *ch;            /* extra descriptors (cli_spawn_opts_t) */
+    size_t       nch;
+    cli_trace_t *trace;         /* NULL = not recorded */
 } child_pipes_t;
 
 
 /******************************
  * Global variables and types *
  ******************************/
+/* Session configuration, set before cli_session_start() and preserved by it */
+typedef struct
+{
+    cli_delivery_t   delivery;
+    cli_ring_opts_t  ring;
+    size_t           expect_window;
+    cli_spawn_opts_t spawn;       /* fds is an owned copy */
+    size_t           coalesce_bytes;  /* 0 = deliver every read */
+    unsigned         coalesce_us;
+} session_cfg_t;
+
+/* One-shot jobs - Exit check period where pidfds are not available */
+#define ONESHOT_REAP_POLL_MS    10
+
+/* Trace file header (host byte order), followed by the records */
+#define TRACE_MAGIC     "CLITRACE"
+#define TRACE_VERSION   1
+#define TRACE_BUFSIZE   65536
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t flags;
+} trace_hdr_t;
+
+/* Opaque struct referenced outside through cli_trace_t type (defined in clirunner.h) */
+struct cli_trace {
+    pthread_mutex_t lock;
+    int             fd;
+    unsigned        flags;
+    char           *buf;            /* TRACE_BUFSIZE bytes */
+    size_t          len;
+    int             err;            /* first write error, 0 = none */
+};
+
+/* Opaque struct referenced outside through oneshot_job_t type (defined in clirunner.h) */
+struct oneshot_job {
+    child_pipes_t  cp;
+    const uint8_t *in;            /* stdin payload (owned by caller) */
+    size_t         in_len;
+    size_t         in_off;
+    dynbuf_t       out;
+    dynbuf_t       err;
+    int            pidfd;         /* readable once the child exits, -1 = not available */
+    bool           reaped;
+    int            status;        /* waitpid() status, once reaped */
+};
+
+/* Opaque struct referenced outside through cli_supervisor_t type (defined in clirunner.h) */
+struct cli_supervisor {
+    pthread_t        th;
+    pthread_mutex_t  lock;
+    int              ctl_pipe[2];     /* wakes up the event thread */
+    daemon_t       **d;               /* indexed by daemon id, append only */
+    size_t           n;
+    size_t           cap;
+    bool             destroying;
+};
+
 /* Opaque struct referenced outside through cli_session_t type (defined in clirunner.h) */
 struct cli_session {
     pthread_t     th;
@@ -85,6 +247,14 @@ struct cli_session {
     cli_callbacks_t cb;
     int           ctl_pipe[2];
     atomic_bool   running;
+    bool          started;        /* from cli_session_start() to cli_session_join() */
+    session_cfg_t cfg;
+    ring_t       *ring;           /* CLI_DELIVERY_RING only */
+    atomic_bool   finished;       /* child reaped, exit_code valid */
+    int           exit_code;
+    bool          exit_delivered;
+    dynbuf_t      pend[2];        /* pull mode: stdout/stderr read ahead by cli_session_expect() */
+    size_t        pend_off[2];    /* consumed prefix of pend[] */
 };
 
 
@@ -128,20 +298,6 @@ static int db_reserve(dynbuf_t *b, size_t need)
     return 0;
 }
 
-static int db_append(dynbuf_t *b, const void *src, size_t n)
-{
-    if (!n)
-        return 0;
-
-    if (db_reserve(b, b->len + n + 1))
-        return -1;
-    memcpy(b->data + b->len, src, n);
-    b->len += n;
-    b->data[b->len] = '\0';
-
-    return 0;
-}
-
 static int64_t now_ms(void)
 {
     /* Local Variables */
@@ -152,390 +308,2640 @@ static int64_t now_ms(void)
     return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static int set_nonblock(int fd)
+static uint64_t now_ns(void)
 {
-    int fl = fcntl(fd, F_GETFL, 0);
+    /* Local Variables */
+    struct timespec ts;
 
-    return (fl < 0) ? -1 : fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
 }
 
-static int write_all(int fd, const void *buf, size_t len, int timeout_ms)
+static int write_all(int fd, const void *buf, size_t n)
 {
-    const uint8_t *p = buf;
-    size_t left = len;
-    int64_t deadline = (timeout_ms >= 0) ? now_ms() + timeout_ms : -1;
+    /* Local Variables */
+    const char *p = buf;
+    ssize_t     w;
 
-    while (left > 0)
+    while (n)
     {
-        ssize_t n = write(fd, p, left);
-
-        if (n > 0)
-        {
-            p += n;
-            left -= n;
-            continue;
-        }
-        if (n < 0 && errno == EINTR)
-            continue;
-        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        w = write(fd, p, n);
+        if (w < 0)
         {
-            if (deadline >= 0 && now_ms() > deadline)
-            {
-                errno = ETIMEDOUT;
-                return -1;
-            }
-            struct pollfd pfd = { fd, POLLOUT, 0 };
-            poll(&pfd, 1, 50);
-            continue;
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
-        return -1;
+        p += w;
+        n -= w;
     }
     return 0;
 }
 
-static int spawn_with_pipes(const char *cmd, char *const argv[], child_pipes_t *cp)
+/* Writes the buffered records (lock held). After an error the */
+/* recorder discards everything, cli_trace_close() reports it  */
+static int trace_flush_locked(cli_trace_t *t)
 {
-    int   in_p[2],
-          out_p[2],
-          err_p[2];
-    pid_t pid;
-
-    if (pipe(in_p) || pipe(out_p) || pipe(err_p))
-        return -1;
-
-    pid = fork();
+    if (!t->err && t->len && write_all(t->fd, t->buf, t->len) < 0)
+        t->err = errno;
+    t->len = 0;
 
-    if (pid < 0)
-        return -1;
+    return t->err ? -1 : 0;
+}
 
-    if (pid == 0)
+static void trace_put(cli_trace_t *t, const void *data, size_t n)
+{
+    if (t->len + n > TRACE_BUFSIZE)
+        trace_flush_locked(t);
+    if (n > TRACE_BUFSIZE)
     {
-        dup2(in_p[0], STDIN_FILENO);
-        dup2(out_p[1], STDOUT_FILENO);
-        dup2(err_p[1], STDERR_FILENO);
+        /* Larger than the whole buffer --> straight to the file */
+        if (!t->err && write_all(t->fd, data, n) < 0)
+            t->err = errno;
+        return;
+    }
+    memcpy(t->buf + t->len, data, n);
+    t->len += n;
+}
 
-        close(in_p[0]); close(in_p[1]);
-        close(out_p[0]); close(out_p[1]);
-        close(err_p[0]); close(err_p[1]);
+/* Records an event of the child of cp (no-op when not traced). */
+/* Data is stored only with CLI_TRACE_PAYLOAD, except at spawn  */
+static void trace_event(const child_pipes_t *cp, int type, int stream, int64_t value,
+                        const void *data, size_t len, uint64_t ts)
+{
+    /* Local Variables */
+    cli_trace_t        *t = cp->trace;
+    cli_trace_record_t  rec;
+
+    if (!t)
+        return;
+    if (type != CLI_TRACE_SPAWN && !(t->flags & CLI_TRACE_PAYLOAD))
+        len = 0;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.ts_ns = ts ? ts : now_ns();
+    rec.value = value;
+    rec.pid = cp->pid;
+    rec.len = (uint32_t)len;
+    rec.stream = (int16_t)stream;
+    rec.type = (uint8_t)type;
+
+    pthread_mutex_lock(&t->lock);
+    trace_put(t, &rec, sizeof(rec));
+    if (len)
+        trace_put(t, data, len);
+    pthread_mutex_unlock(&t->lock);
+}
 
-        execvp(cmd, argv);
-        _exit(127);
-    }
+static int set_nonblock(int fd)
+{
+    int fl = fcntl(fd, F_GETFL, 0);
 
-    close(in_p[0]);
-    close(out_p[1]);
-    close(err_p[1]);
+    return (fl < 0) ? -1 : fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
 
-    cp->pid = pid;
-    cp->in_w = in_p[1];
-    cp->out_r = out_p[0];
-    cp->err_r = err_p[0];
+#if !defined(__linux__) || !defined(SOCK_CLOEXEC) || !defined(MFD_CLOEXEC)
+static int set_cloexec(int fd)
+{
+    int fl = fcntl(fd, F_GETFD, 0);
 
-    set_nonblock(cp->in_w);
-    set_nonblock(cp->out_r);
-    set_nonblock(cp->err_r);
+    return (fl < 0) ? -1 : fcntl(fd, F_SETFD, fl | FD_CLOEXEC);
+}
+#endif
 
+/* pipe() with both ends close-on-exec, atomically where pipe2() exists */
+static int pipe_cloexec(int p[2])
+{
+#ifdef __linux__
+    return pipe2(p, O_CLOEXEC);
+#else
+    if (pipe(p) < 0)
+        return -1;
+    set_cloexec(p[0]);
+    set_cloexec(p[1]);
     return 0;
+#endif
 }
 
-static void *session_thread(void *arg)
+static void deadline_to_abstime(int64_t deadline, struct timespec *ts)
 {
-    /* Local Variables */
-    cli_session_t *s = arg;
-    char           buf[8192];
-    int            open,
-                   status,
-                   exit_code,
-                   r,
-                   i;
-    ssize_t        n;
-
-    atomic_store(&s->running, true);
+    ts->tv_sec = deadline / 1000;
+    ts->tv_nsec = (deadline % 1000) * 1000000;
+}
 
-    struct pollfd pfds[3] = { { s->cp.out_r, POLLIN, 0 },
-                              { s->cp.err_r, POLLIN, 0 },
-                              { s->ctl_pipe[0], POLLIN, 0 } };
+static ring_seg_t *ring_seg_alloc(size_t nslots, size_t slot_size)
+{
+    /* Local Variables */
+    ring_seg_t *seg;
+    size_t      i;
 
-    open = 2;
+    seg = calloc(1, sizeof(*seg));
+    if (!seg)
+        return NULL;
 
-    while (atomic_load(&s->running) && open > 0)
+    seg->slots = calloc(nslots, sizeof(ring_slot_t));
+    seg->pool = malloc(nslots * slot_size);
+    if (!seg->slots || !seg->pool)
     {
-        r = poll(pfds, 3, 2000);
-        if (r < 0)
-        {
-            if (errno == EINTR) continue;
-            break; /* Critical Error --> exit from the loop */
-        }
-        if (r == 0) continue; /* Timeout --> loop again */
-
-        if (pfds[2].revents & POLLIN)
-            break;
-
-        for (i = 0; i < 2; i++)
-        {
-            if (pfds[i].fd < 0)
-                continue;
-            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
-            {
-                while ((n = read(pfds[i].fd, buf, sizeof(buf))) > 0)
-                {
-                    if (i == 0 && s->cb.on_stdout)
-                        s->cb.on_stdout(s, buf, n);
-                    if (i == 1 && s->cb.on_stderr)
-                        s->cb.on_stderr(s, buf, n);
-                }
-                if (n == 0)
-                {
-                    /* EOF --> close descriptor */
-                    close(pfds[i].fd);
-                    pfds[i].fd = -1;
-                    open--;
-                }
-            }
-        }
+        free(seg->slots);
+        free(seg->pool);
+        free(seg);
+        return NULL;
     }
 
-    waitpid(s->cp.pid, &status, 0);
-    exit_code = WIFEXITED(status) ? WEXITSTATUS(status) :  WIFSIGNALED(status) ? 128 + WTERMSIG(status) : -1;
+    for (i = 0; i < nslots; i++)
+        seg->slots[i].data = seg->pool + i * slot_size;
 
-    if (s->cb.on_exit)
-        s->cb.on_exit(s, exit_code);
+    seg->mask = nslots - 1;
+    atomic_init(&seg->next, NULL);
+    atomic_init(&seg->head, 0);
+    atomic_init(&seg->tail, 0);
 
-    return NULL;
+    return seg;
 }
 
-
-/***************************
- *  Public Functions (API) *
- ***************************/
-/* One-shot execution API - Free buffers inside oneshot_result_t */
-void oneshot_result_free(oneshot_result_t *r)
+static void ring_seg_free(ring_seg_t *seg)
 {
-    if (!r) return;
-    free(r->out);
-    free(r->err);
-    memset(r, 0, sizeof(*r));
+    free(seg->slots);
+    free(seg->pool);
+    free(seg);
 }
 
-/* One-shot execution API - Execute a command and wait for completion
-   - cmd           executable name (searched via PATH)
-   - argv          argv array (argv[0] should be cmd)
-   - stdin_payload optional input buffer
-   - stdin_len     size of stdin_payload
-   - timeout_ms    <0 = infinite
-   - res_out       result structure (output buffers owned by caller)
-   Returns 0 on success, -1 on error (errno set) */
-int run_oneshot(const char *cmd, char *const argv[],
-                const void *stdin_payload, size_t stdin_len,
-                int timeout_ms,
-                oneshot_result_t *res)
+static ring_t *ring_create(const cli_ring_opts_t *o)
 {
     /* Local Variables */
-    child_pipes_t   cp;
-    dynbuf_t        bout,
-                    berr;
-    int             open,
-                    tmo,
-                    status,
-                    r,
-                    i;
-    char            buf[8192];
-    int64_t         deadline,
-                    now;
-    ssize_t         n;
+    ring_t            *r;
+    pthread_condattr_t ca;
+    size_t             nslots = 1;
 
-    if (!cmd || !argv || !res)
+    while (nslots < (o->slots ? o->slots : 64))
+        nslots <<= 1;
+
+    r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    r->slot_size = o->slot_size ? o->slot_size : 8192;
+    r->policy = o->policy;
+    r->prod = r->cons = ring_seg_alloc(nslots, r->slot_size);
+    if (!r->prod)
     {
-        errno = EINVAL;
-        return -1;
+        free(r);
+        return NULL;
     }
-    memset(res, 0, sizeof(*res));
-    signal(SIGPIPE, SIG_IGN);
+    atomic_init(&r->capacity, nslots);
 
-    if (spawn_with_pipes(cmd, argv, &cp) < 0)
-        return -1;
-    
-    db_init(&bout);
-    db_init(&berr);
+    /* Timed waits are computed on CLOCK_MONOTONIC, as everything else */
+    pthread_condattr_init(&ca);
+    pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->not_empty, &ca);
+    pthread_cond_init(&r->not_full, &ca);
+    pthread_condattr_destroy(&ca);
+
+    return r;
+}
+
+static void ring_destroy(ring_t *r)
+{
+    /* Local Variables */
+    ring_seg_t *seg,
+               *next;
+
+    if (!r)
+        return;
 
-    if (stdin_payload && stdin_len)
+    for (seg = r->cons; seg; seg = next)
     {
-        if (write_all(cp.in_w, stdin_payload, stdin_len, timeout_ms) < 0)
-            goto fail;
+        next = atomic_load(&seg->next);
+        ring_seg_free(seg);
     }
-    close(cp.in_w);
-    cp.in_w = -1;
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->not_empty);
+    pthread_cond_destroy(&r->not_full);
+    free(r);
+}
 
-    struct pollfd pfds[2] = { { cp.out_r, POLLIN, 0 },
-                              { cp.err_r, POLLIN, 0 }  };
+/* Wakes up the other side if it is parked. The fence pairs with the  */
+/* one in ring_park(), so that either the waiter sees the new state   */
+/* or the notifier sees the waiting flag (no lost wakeups)            */
+static void ring_notify(ring_t *r, atomic_bool *waiting, pthread_cond_t *cv)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed))
+    {
+        pthread_mutex_lock(&r->lock);
+        pthread_cond_signal(cv);
+        pthread_mutex_unlock(&r->lock);
+    }
+}
 
-    open = 2;
-    deadline = (timeout_ms >= 0) ? now_ms() + timeout_ms : -1;
+/* Parks the caller until notified or until deadline (ms, <0 = none), */
+/* unless ready(arg) already holds once the waiting flag is visible   */
+static void ring_park(ring_t *r, atomic_bool *waiting, pthread_cond_t *cv,
+                      bool (*ready)(void *), void *arg, int64_t deadline)
+{
+    /* Local Variables */
+    struct timespec ts;
 
-    while (open > 0)
+    pthread_mutex_lock(&r->lock);
+    atomic_store(waiting, true);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!ready(arg))
     {
-        tmo = -1;
-        if (deadline >= 0)
+        if (deadline < 0)
+            pthread_cond_wait(cv, &r->lock);
+        else
         {
-            now = now_ms();
-            if (now >= deadline) goto timeout;
-            tmo = (int)(deadline - now);
+            deadline_to_abstime(deadline, &ts);
+            pthread_cond_timedwait(cv, &r->lock, &ts);
         }
+    }
+    atomic_store(waiting, false);
+    pthread_mutex_unlock(&r->lock);
+}
 
-        r = poll(pfds, 2, tmo);
-        if (r < 0 && errno != EINTR)
-            goto fail;
-        if (r == 0)
-            goto timeout;
+static bool ring_has_space(void *arg)
+{
+    ring_t     *r = arg;
+    ring_seg_t *seg = r->prod;
 
-        for (i = 0; i < 2; i++)
+    return atomic_load(&seg->head) - atomic_load(&seg->tail) <= seg->mask;
+}
+
+/* Producer side (session thread) - Queues n bytes, split over as many */
+/* slots as needed. Returns 0 when queued, -1 when (partly) dropped    */
+static int ring_push(ring_t *r, int stream, const char *data, size_t n,
+                     atomic_bool *running)
+{
+    /* Local Variables */
+    ring_seg_t  *seg,
+                *nseg;
+    ring_slot_t *slot;
+    size_t       h,
+                 t,
+                 c,
+                 occ,
+                 hw;
+
+    while (n > 0)
+    {
+        seg = r->prod;
+        h = atomic_load_explicit(&seg->head, memory_order_relaxed);
+        t = atomic_load_explicit(&seg->tail, memory_order_acquire);
+
+        if (h - t > seg->mask)
         {
-            if (pfds[i].fd < 0)
+            /* Ring full */
+            if (r->policy == CLI_RING_GROW &&
+                (nseg = ring_seg_alloc((seg->mask + 1) * 2, r->slot_size)) != NULL)
+            {
+                atomic_store_explicit(&seg->next, nseg, memory_order_release);
+                r->prod = nseg;
+                atomic_fetch_add(&r->capacity, nseg->mask + 1);
+                atomic_fetch_add(&r->grows, 1);
                 continue;
-            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            }
+            if (r->policy == CLI_RING_DROP || !atomic_load(running))
             {
-                for (;;)
-                {
-                    n = read(pfds[i].fd, buf, sizeof(buf));
-                    if (n > 0)
-                    {
-                        db_append(i ? &berr : &bout, buf, n);
-                    }
-                    else if (n == 0 || errno == EAGAIN)
-                    {
-                        close(pfds[i].fd);
-                        pfds[i].fd = -1;
-                        open--;
-                        break;
-                    } else if (errno != EINTR)
-                    {
-                        goto fail;
-                    }
-                }
+                atomic_fetch_add(&r->dropped, 1);
+                atomic_fetch_add(&r->dropped_bytes, n);
+                return -1;
             }
+            /* CLI_RING_BLOCK (or GROW without memory): wait for the     */
+            /* consumer, but wake up periodically to honour a stop request */
+            atomic_fetch_add(&r->stalls, 1);
+            ring_park(r, &r->prod_waiting, &r->not_full, ring_has_space, r,
+                      now_ms() + 100);
+            continue;
         }
-    }
 
-    waitpid(cp.pid, &status, 0);
-    res->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : WIFSIGNALED(status) ? 128 + WTERMSIG(status) : -1;
-    res->out = bout.data; res->out_len = bout.len;
-    res->err = berr.data; res->err_len = berr.len;
+        slot = &seg->slots[h & seg->mask];
+        c = (n < r->slot_size) ? n : r->slot_size;
+        memcpy(slot->data, data, c);
+        slot->len = c;
+        slot->stream = stream;
+
+        /* Counters move before the slot is handed over (and popped before */
+        /* it is freed), so that 0 <= pushed - popped <= capacity holds    */
+        occ = atomic_fetch_add(&r->pushed, 1) + 1 - atomic_load(&r->popped);
+        atomic_store_explicit(&seg->head, h + 1, memory_order_release);
+
+        hw = atomic_load_explicit(&r->high_watermark, memory_order_relaxed);
+        while (occ > hw &&
+               !atomic_compare_exchange_weak(&r->high_watermark, &hw, occ))
+            ;
+
+        data += c;
+        n -= c;
+        ring_notify(r, &r->cons_waiting, &r->not_empty);
+    }
 
     return 0;
+}
 
-timeout:
-    kill(cp.pid, SIGTERM);
-    poll(NULL, 0, 200);
-    kill(cp.pid, SIGKILL);
-    waitpid(cp.pid, NULL, 0);
+/* Consumer side - Returns the oldest queued slot, or NULL when empty */
+static ring_slot_t *ring_peek(ring_t *r)
+{
+    /* Local Variables */
+    ring_seg_t *seg,
+               *next;
+    size_t      t;
 
-fail:
+    for (;;)
     {
-        int e = errno;
-        db_free(&bout); db_free(&berr);
-        waitpid(cp.pid, NULL, WNOHANG);
-        errno = e;
-        return -1;
+        seg = r->cons;
+        t = atomic_load_explicit(&seg->tail, memory_order_relaxed);
+        if (t != atomic_load_explicit(&seg->head, memory_order_acquire))
+            return &seg->slots[t & seg->mask];
+
+        next = atomic_load_explicit(&seg->next, memory_order_acquire);
+        if (!next)
+            return NULL;
+
+        /* The producer links the next segment only after its last */
+        /* publish here, so a second look at head is conclusive    */
+        if (t != atomic_load_explicit(&seg->head, memory_order_acquire))
+            return &seg->slots[t & seg->mask];
+
+        r->cons = next;
+        atomic_fetch_sub(&r->capacity, seg->mask + 1);
+        ring_seg_free(seg);
     }
 }
 
+/* Consumer side - Gives the slot returned by ring_peek() back to the pool */
+static void ring_release(ring_t *r)
+{
+    ring_seg_t *seg = r->cons;
 
-/* Interactive session API - Create an interactive CLI session */
-/* Returns the pointer to the newly created session            */
-cli_session_t *cli_session_create(void)
+    atomic_fetch_add(&r->popped, 1);
+    atomic_store_explicit(&seg->tail,
+                          atomic_load_explicit(&seg->tail, memory_order_relaxed) + 1,
+                          memory_order_release);
+    ring_notify(r, &r->prod_waiting, &r->not_full);
+}
+
+static bool session_dispatch_ready(void *arg)
 {
-    return calloc(1, sizeof(struct cli_session));
+    cli_session_t *s = arg;
+
+    return atomic_load(&s->finished) || ring_peek(s->ring) != NULL;
 }
 
-/* Interactive session API - Start an interactive CLI session */
-/* Forks the process and launches the command cmd with its    */
-/* arguments argv[] in the child. It returns only in the      */
-/* parent, where it creates a thread which monitors the child */
-/* and handles callback functions. It returns the result of   */
-/* pthread_create(), i.e. 0 on success                        */
-int cli_session_start(cli_session_t *s,
-                      const char *cmd,
-                      char *const argv[],
-                      const cli_callbacks_t *cb)
+/* Invokes the output callback of stream (timed, when traced) */
+static void session_callback(cli_session_t *s, int stream, const char *buf, size_t n)
+{
+    /* Local Variables */
+    uint64_t t0 = s->cp.trace ? now_ns() : 0;
+
+    if (stream == CLI_STREAM_STDOUT && s->cb.on_stdout)
+        s->cb.on_stdout(s, buf, n);
+    else if (stream == CLI_STREAM_STDERR && s->cb.on_stderr)
+        s->cb.on_stderr(s, buf, n);
+    else if (stream > CLI_STREAM_STDERR && s->cfg.spawn.on_channel)
+        s->cfg.spawn.on_channel(s, stream, buf, n);
+    else
+        return;
+
+    if (t0)
+        trace_event(&s->cp, CLI_TRACE_CALLBACK, stream, (int64_t)(now_ns() - t0), NULL, 0, t0);
+}
+
+static void session_deliver(cli_session_t *s, int stream, const char *buf, size_t n)
 {
+    if (s->ring)
+        ring_push(s->ring, stream, buf, n, &s->running);
+    else
+        session_callback(s, stream, buf, n);
+}
 
-    if (!s || !cmd || !argv)
+static int exit_code_of(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : WIFSIGNALED(status) ? 128 + WTERMSIG(status) : -1;
+}
+
+static void close_fd(int *fd)
+{
+    if (*fd >= 0)
     {
-        errno = EINVAL;
-        return -1;
+        close(*fd);
+        *fd = -1;
     }
+}
 
-    memset(s, 0, sizeof(*s));
-    if (cb)
-        s->cb = *cb;
+/* Child side (between fork and exec, async-signal-safe only): makes */
+/* src the descriptor target, inherited across exec                  */
+static void child_dup(int src, int target)
+{
+    if (src == target)
+        fcntl(target, F_SETFD, 0);
+    else
+        dup2(src, target);
+}
 
-    if (spawn_with_pipes(cmd, argv, &s->cp) < 0)
-        return -1;
+/* Child side (async-signal-safe only): maps src[i] onto dst[i]. All   */
+/* sources are first moved above every target (floor), so that no     */
+/* dup2() can overwrite a source still to be mapped                    */
+static void child_remap(int *src, const int *dst, size_t n, int floor)
+{
+    /* Local Variables */
+    size_t i;
+
+    for (i = 0; i < n; i++)
+        src[i] = fcntl(src[i], F_DUPFD_CLOEXEC, floor);
+    for (i = 0; i < n; i++)
+        dup2(src[i], dst[i]);
+}
+
+static int pidfd_open_compat(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int shm_create(const char *name, size_t size, void **addr)
+{
+    /* Local Variables */
+    int   fd;
+    void *p;
+
+#ifdef MFD_CLOEXEC
+    fd = memfd_create(name ? name : "clirunner", MFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+#else
+    {
+        /* POSIX shared memory object, unlinked at once so only the fd refers to it */
+        static atomic_uint seq;
+        char               path[64];
+
+        snprintf(path, sizeof(path), "/%s.%ld.%u", name ? name : "clirunner",
+                 (long)getpid(), atomic_fetch_add(&seq, 1));
+        fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0)
+            return -1;
+        shm_unlink(path);
+        set_cloexec(fd);
+    }
+#endif
+    if (ftruncate(fd, (off_t)size) < 0 ||
+        (p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        int e = errno;
+        close(fd);
+        errno = e;
+        return -1;
+    }
+    *addr = p;
+
+    return fd;
+}
+
+static bool channel_readable(const channel_t *c)
+{
+    return c->kind == CLI_FD_PIPE_OUT || c->kind == CLI_FD_SOCKETPAIR;
+}
+
+static void channels_close(child_pipes_t *cp)
+{
+    /* Local Variables */
+    size_t i;
+
+    for (i = 0; i < cp->nch; i++)
+    {
+        close_fd(&cp->ch[i].fd);
+        if (cp->ch[i].map)
+            munmap(cp->ch[i].map, cp->ch[i].size);
+    }
+    free(cp->ch);
+    cp->ch = NULL;
+    cp->nch = 0;
+}
+
+/* Validates the extra descriptors and creates the library owned ones. */
+/* The descriptor the child must get is stored in child_end[i]         */
+static int channels_open(const cli_spawn_opts_t *o, child_pipes_t *cp, int *child_end)
+{
+    /* Local Variables */
+    const cli_fd_spec_t *f;
+    channel_t           *c;
+    int                  p[2];
+    size_t               i,
+                         j;
+
+    cp->ch = calloc(o->nfds, sizeof(channel_t));
+    if (!cp->ch)
+        return -1;
+    cp->nch = o->nfds;
+    for (i = 0; i < o->nfds; i++)
+        cp->ch[i].fd = child_end[i] = -1;
+
+    for (i = 0; i < o->nfds; i++)
+    {
+        f = &o->fds[i];
+        c = &cp->ch[i];
+        c->child_fd = f->child_fd;
+        c->kind = f->kind;
+
+        for (j = 0; j < i; j++)
+        {
+            if (o->fds[j].child_fd == f->child_fd)
+                goto inval;
+        }
+        if (f->child_fd <= STDERR_FILENO)
+            goto inval;
+
+        switch (f->kind)
+        {
+            case CLI_FD_INHERIT:
+                if (f->parent_fd < 0)
+                    goto inval;
+                child_end[i] = f->parent_fd;
+                break;
+
+            case CLI_FD_PIPE_IN:
+            case CLI_FD_PIPE_OUT:
+                if (pipe_cloexec(p) < 0)
+                    goto fail;
+                c->fd = (f->kind == CLI_FD_PIPE_IN) ? p[1] : p[0];
+                child_end[i] = (f->kind == CLI_FD_PIPE_IN) ? p[0] : p[1];
+                set_nonblock(c->fd);
+                break;
+
+            case CLI_FD_SOCKETPAIR:
+#ifdef SOCK_CLOEXEC
+                if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, p) < 0)
+                    goto fail;
+#else
+                if (socketpair(AF_UNIX, SOCK_STREAM, 0, p) < 0)
+                    goto fail;
+                set_cloexec(p[0]);
+                set_cloexec(p[1]);
+#endif
+                c->fd = p[0];
+                child_end[i] = p[1];
+                set_nonblock(c->fd);
+                break;
+
+            case CLI_FD_MEMFD:
+                if (!f->size)
+                    goto inval;
+                if ((c->fd = shm_create("clirunner", f->size, &c->map)) < 0)
+                    goto fail;
+                c->size = f->size;
+                child_end[i] = c->fd;   /* the same region on both sides */
+                break;
+
+            default:
+                goto inval;
+        }
+    }
+
+    return 0;
+
+inval:
+    errno = EINVAL;
+fail:
+    {
+        int e = errno;
+        for (i = 0; i < o->nfds; i++)
+        {
+            if (o->fds[i].kind != CLI_FD_INHERIT && o->fds[i].kind != CLI_FD_MEMFD)
+                close_fd(&child_end[i]);
+        }
+        channels_close(cp);
+        errno = e;
+        return -1;
+    }
+}
+
+static int spawn_with_pipes(const char *cmd, char *const argv[],
+                            const cli_spawn_opts_t *opts, child_pipes_t *cp)
+{
+    int              in_p[2] = { -1, -1 },
+                     out_p[2] = { -1, -1 },
+                     err_p[2] = { -1, -1 },
+                     devnull = -1,
+                     std_src[3],
+                     std_dst[3],
+                     floor = STDERR_FILENO + 1,
+                     first,
+                    *src = std_src,
+                    *dst = std_dst;
+    size_t           nfds = (opts && opts->fds) ? opts->nfds : 0,
+                     i;
+    bool             merge = opts && opts->merge_stderr;
+    cli_stdin_mode_t in_mode = opts ? opts->stdin_mode : CLI_STDIN_PIPE;
+    pid_t            pid;
+
+    cp->ch = NULL;
+    cp->nch = 0;
+    cp->trace = opts ? opts->trace : NULL;
+
+    if (in_mode < CLI_STDIN_PIPE || in_mode > CLI_STDIN_CLOSED)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    first = (in_mode == CLI_STDIN_CLOSED) ? 1 : 0;
+
+    /* Source/target tables are built before fork(): the child may */
+    /* only use async-signal-safe functions                        */
+    if (nfds)
+    {
+        src = malloc((3 + nfds) * sizeof(int));
+        dst = malloc((3 + nfds) * sizeof(int));
+        if (!src || !dst || channels_open(opts, cp, src + 3) < 0)
+            goto fail;
+        for (i = 0; i < nfds; i++)
+        {
+            dst[3 + i] = opts->fds[i].child_fd;
+            if (dst[3 + i] >= floor)
+                floor = dst[3 + i] + 1;
+        }
+    }
+
+    /* Close-on-exec, so that other children never inherit the parent */
+    /* ends (a stray write end would hold off EOF on these pipes)     */
+    /* A merged stderr and a stdin not written by the parent need no pipe */
+    if (pipe_cloexec(out_p) ||
+        (!merge && pipe_cloexec(err_p)) ||
+        (in_mode == CLI_STDIN_PIPE && pipe_cloexec(in_p)) ||
+        (in_mode == CLI_STDIN_NULL && (devnull = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0))
+        goto fail;
+
+    src[0] = (in_mode == CLI_STDIN_PIPE) ? in_p[0] : devnull;  dst[0] = STDIN_FILENO;
+    src[1] = out_p[1];                                           dst[1] = STDOUT_FILENO;
+    src[2] = merge ? out_p[1] : err_p[1];                        dst[2] = STDERR_FILENO;
+
+    pid = fork();
+
+    if (pid < 0)
+        goto fail;
+
+    if (pid == 0)
+    {
+        child_remap(src + first, dst + first, 3 + nfds - first, floor);
+        if (in_mode == CLI_STDIN_CLOSED)
+            close(STDIN_FILENO);
+
+        execvp(cmd, argv);
+        _exit(127);
+    }
+
+    close_fd(&in_p[0]);
+    close_fd(&devnull);
+    close_fd(&out_p[1]);
+    close_fd(&err_p[1]);
+    for (i = 0; i < nfds; i++)
+    {
+        /* The child has its copy of the library created ends */
+        if (cp->ch[i].kind != CLI_FD_INHERIT && cp->ch[i].kind != CLI_FD_MEMFD)
+            close(src[3 + i]);
+    }
+    if (nfds)
+    {
+        free(src);
+        free(dst);
+    }
+
+    cp->pid = pid;
+    cp->in_w = in_p[1];
+    cp->out_r = out_p[0];
+    cp->err_r = err_p[0];
+
+    if (cp->in_w >= 0)
+        set_nonblock(cp->in_w);
+    set_nonblock(cp->out_r);
+    if (cp->err_r >= 0)
+        set_nonblock(cp->err_r);
+
+    trace_event(cp, CLI_TRACE_SPAWN, -1, 0, cmd, strlen(cmd), 0);
+
+    return 0;
+
+fail:
+    {
+        int e = errno;
+        close_fd(&in_p[0]); close_fd(&in_p[1]);
+        close_fd(&out_p[0]); close_fd(&out_p[1]);
+        close_fd(&err_p[0]); close_fd(&err_p[1]);
+        close_fd(&devnull);
+        for (i = 0; i < cp->nch; i++)
+        {
+            if (cp->ch[i].kind != CLI_FD_INHERIT && cp->ch[i].kind != CLI_FD_MEMFD)
+                close(src[3 + i]);
+        }
+        channels_close(cp);
+        if (nfds)
+        {
+            free(src);
+            free(dst);
+        }
+        errno = e;
+        return -1;
+    }
+}
+
+static channel_t *session_channel(cli_session_t *s, int child_fd)
+{
+    /* Local Variables */
+    size_t i;
+
+    for (i = 0; i < s->cp.nch; i++)
+    {
+        if (s->cp.ch[i].child_fd == child_fd)
+            return &s->cp.ch[i];
+    }
+    return NULL;
+}
+
+static int *session_stream_fd(cli_session_t *s, int stream)
+{
+    /* Local Variables */
+    channel_t *c;
+
+    switch (stream)
+    {
+        case CLI_STREAM_STDIN:  return &s->cp.in_w;
+        case CLI_STREAM_STDOUT: return &s->cp.out_r;
+        case CLI_STREAM_STDERR: return &s->cp.err_r;
+        default:                return (c = session_channel(s, stream)) ? &c->fd : NULL;
+    }
+}
+
+static void matchers_free(matcher_t *m, size_t n)
+{
+    /* Local Variables */
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        free(m[i].fail);
+        if (m[i].re_ok)
+            regfree(&m[i].re);
+    }
+    free(m);
+}
+
+static matcher_t *matchers_build(const cli_pattern_t *pats, size_t n)
+{
+    /* Local Variables */
+    matcher_t *m;
+    size_t     i,
+               j,
+               k;
+
+    m = calloc(n, sizeof(*m));
+    if (!m)
+        return NULL;
+
+    for (i = 0; i < n; i++)
+    {
+        m[i].p = &pats[i];
+        if (!pats[i].pattern || !*pats[i].pattern ||
+            (pats[i].stream != CLI_STREAM_STDOUT && pats[i].stream != CLI_STREAM_STDERR &&
+             pats[i].stream != CLI_STREAM_ANY))
+            goto fail;
+
+        if (pats[i].kind == CLI_EXPECT_REGEX)
+        {
+            /* Line anchored: ^ and $ match around newlines */
+            if (regcomp(&m[i].re, pats[i].pattern, REG_EXTENDED | REG_NEWLINE))
+                goto fail;
+            m[i].re_ok = true;
+            continue;
+        }
+        if (pats[i].kind != CLI_EXPECT_LITERAL)
+            goto fail;
+
+        /* KMP failure table: matches survive any split across reads */
+        m[i].len = strlen(pats[i].pattern);
+        m[i].fail = calloc(m[i].len, sizeof(size_t));
+        if (!m[i].fail)
+            goto fail;
+        for (j = 1, k = 0; j < m[i].len; j++)
+        {
+            while (k && pats[i].pattern[j] != pats[i].pattern[k])
+                k = m[i].fail[k - 1];
+            if (pats[i].pattern[j] == pats[i].pattern[k])
+                k++;
+            m[i].fail[j] = k;
+        }
+    }
+    return m;
+
+fail:
+    matchers_free(m, n);
+    errno = EINVAL;
+    return NULL;
+}
+
+/* Feeds bytes [from, to) of stream st to the literal matchers and the  */
+/* window [wstart, to) to the regex matchers. Returns the index of the  */
+/* match ending first (ties go to the lowest index) or -1, and sets the */
+/* match boundaries (absolute offsets inside buf). A literal match may  */
+/* begin in output already dropped: its start is clamped to keep, the   */
+/* first byte still buffered (never to wstart, which may follow it)     */
+static int matchers_scan(matcher_t *m, size_t n, int st, const char *buf,
+                         size_t wstart, size_t keep, size_t from, size_t to,
+                         size_t *mstart, size_t *mend)
+{
+    /* Local Variables */
+    regmatch_t rm;
+    size_t     i,
+               j,
+               k,
+               end,
+               best_end = SIZE_MAX;
+    int        best = -1;
+
+    for (i = 0; i < n; i++)
+    {
+        if (m[i].p->stream != CLI_STREAM_ANY && m[i].p->stream != st)
+            continue;
+
+        if (m[i].re_ok)
+        {
+            /* Pending buffers are NUL terminated. Their end is not an  */
+            /* end of line (more output may follow), nor a window start */
+            /* in mid-line a beginning of line                          */
+            if (regexec(&m[i].re, buf + wstart, 1, &rm,
+                        REG_NOTEOL | ((wstart && buf[wstart - 1] != '\n') ? REG_NOTBOL : 0)) == 0 &&
+                wstart + rm.rm_eo < best_end)
+            {
+                best = (int)i;
+                best_end = wstart + rm.rm_eo;
+                *mstart = wstart + rm.rm_so;
+            }
+            continue;
+        }
+
+        k = m[i].state[st - 1];
+        for (j = from; j < to && j < best_end; j++)
+        {
+            while (k && buf[j] != m[i].p->pattern[k])
+                k = m[i].fail[k - 1];
+            if (buf[j] == m[i].p->pattern[k])
+                k++;
+            if (k == m[i].len)
+            {
+                end = j + 1;
+                best = (int)i;
+                best_end = end;
+                *mstart = (end >= keep + m[i].len) ? end - m[i].len : keep;
+                k = 0;
+                break;
+            }
+        }
+        m[i].state[st - 1] = k;
+    }
+
+    if (best >= 0)
+        *mend = best_end;
+
+    return best;
+}
+
+/* Drops the consumed prefix of a pending buffer */
+static void pend_compact(cli_session_t *s, int idx)
+{
+    /* Local Variables */
+    dynbuf_t *b = &s->pend[idx];
+    size_t    off = s->pend_off[idx];
+
+    if (!off)
+        return;
+    b->len -= off;
+    memmove(b->data, b->data + off, b->len);
+    b->data[b->len] = '\0';
+    s->pend_off[idx] = 0;
+}
+
+/* Delivers the output held for a stream (coalescing) */
+static void session_flush(cli_session_t *s, int stream, dynbuf_t *hold)
+{
+    if (hold->len)
+        session_deliver(s, stream, hold->data, hold->len);
+    hold->len = 0;
+}
+
+/* Reads the available output of a stream into its hold buffer, and  */
+/* delivers it once coalesce_bytes are held. The delay deadline is   */
+/* armed by the first byte held. Returns as the last read()          */
+static ssize_t session_read_held(cli_session_t *s, int fd, int stream,
+                                 dynbuf_t *hold, uint64_t *due)
+{
+    /* Local Variables */
+    ssize_t n;
+
+    for (;;)
+    {
+        if (db_reserve(hold, hold->len + 8192))
+        {
+            /* No memory to hold more: deliver what is there */
+            session_flush(s, stream, hold);
+            if (db_reserve(hold, 8192))
+            {
+                errno = ENOMEM;
+                return -1;
+            }
+        }
+        n = read(fd, hold->data + hold->len, 8192);
+        if (n <= 0)
+            return n;
+
+        trace_event(&s->cp, CLI_TRACE_READ, stream, n, hold->data + hold->len, n, 0);
+        if (!hold->len)
+            *due = now_ns() + (uint64_t)s->cfg.coalesce_us * 1000;
+        hold->len += n;
+        if (hold->len >= s->cfg.coalesce_bytes)
+            session_flush(s, stream, hold);
+    }
+}
+
+static void *session_thread(void *arg)
+{
+    /* Local Variables */
+    cli_session_t *s = arg;
+    char           buf[8192];
+    int            open,
+                   status,
+                   exit_code,
+                   r;
+    nfds_t         nfds = 3,
+                   i;
+    ssize_t        n;
+    bool           coalesce = s->cfg.coalesce_bytes > 0;
+    uint64_t       now,
+                   next;
+#ifdef __linux__
+    struct timespec tmo;
+#endif
+
+    atomic_store(&s->running, true);
+
+    /* stdout, stderr, the control pipe, then the readable channels */
+    int stream[3 + s->cp.nch];
+    struct pollfd pfds[3 + s->cp.nch];
+    dynbuf_t hold[3 + s->cp.nch];     /* coalescing only */
+    uint64_t due[3 + s->cp.nch];
+
+    for (i = 0; i < 3 + s->cp.nch; i++)
+    {
+        db_init(&hold[i]);
+        due[i] = 0;
+    }
+
+    pfds[0] = (struct pollfd){ s->cp.out_r, POLLIN, 0 };
+    pfds[1] = (struct pollfd){ s->cp.err_r, POLLIN, 0 };
+    pfds[2] = (struct pollfd){ s->ctl_pipe[0], POLLIN, 0 };
+    stream[0] = CLI_STREAM_STDOUT;
+    stream[1] = CLI_STREAM_STDERR;
+    stream[2] = -1;
+    for (i = 0; i < s->cp.nch; i++)
+    {
+        if (channel_readable(&s->cp.ch[i]))
+        {
+            stream[nfds] = s->cp.ch[i].child_fd;
+            pfds[nfds++] = (struct pollfd){ s->cp.ch[i].fd, POLLIN, 0 };
+        }
+    }
+
+    /* Streams still open (a merged stderr has no pipe of its own) */
+    for (open = 0, i = 0; i < nfds; i++)
+        open += (i != 2 && pfds[i].fd >= 0);
+
+    while (atomic_load(&s->running) && open > 0)
+    {
+        if (!coalesce)
+            r = poll(pfds, nfds, 2000);
+        else
+        {
+            /* Wake up in time for the nearest held output deadline */
+            now = now_ns();
+            next = now + 2000000000u;
+            for (i = 0; i < nfds; i++)
+            {
+                if (hold[i].len && due[i] < next)
+                    next = (due[i] > now) ? due[i] : now;
+            }
+#ifdef __linux__
+            tmo.tv_sec = (next - now) / 1000000000u;
+            tmo.tv_nsec = (next - now) % 1000000000u;
+            r = ppoll(pfds, nfds, &tmo, NULL);
+#else
+            /* poll() counts in ms: round up, so held output is never flushed early */
+            r = poll(pfds, nfds, (int)((next - now + 999999u) / 1000000u));
+#endif
+        }
+        if (r < 0)
+        {
+            if (errno == EINTR) continue;
+            break; /* Critical Error --> exit from the loop */
+        }
+        if (r == 0 && !coalesce) continue; /* Timeout --> loop again */
+
+        if (pfds[2].revents & POLLIN)
+            break;
+
+        for (i = 0; i < nfds; i++)
+        {
+            if (i == 2 || pfds[i].fd < 0)
+                continue;
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                if (coalesce)
+                    n = session_read_held(s, pfds[i].fd, stream[i], &hold[i], &due[i]);
+                else
+                {
+                    while ((n = read(pfds[i].fd, buf, sizeof(buf))) > 0)
+                    {
+                        trace_event(&s->cp, CLI_TRACE_READ, stream[i], n, buf, n, 0);
+                        session_deliver(s, stream[i], buf, n);
+                    }
+                }
+                if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+                {
+                    /* EOF --> deliver held output, close descriptor */
+                    session_flush(s, stream[i], &hold[i]);
+                    trace_event(&s->cp, CLI_TRACE_EOF, stream[i], 0, NULL, 0, 0);
+                    close_fd(session_stream_fd(s, stream[i]));
+                    pfds[i].fd = -1;
+                    open--;
+                }
+            }
+        }
+
+        if (coalesce)
+        {
+            /* Deliver the output held for max_delay_us */
+            now = now_ns();
+            for (i = 0; i < nfds; i++)
+            {
+                if (hold[i].len && due[i] <= now)
+                    session_flush(s, stream[i], &hold[i]);
+            }
+        }
+    }
+
+    /* Stop request or end of all streams: nothing stays held */
+    for (i = 0; i < nfds; i++)
+    {
+        session_flush(s, stream[i], &hold[i]);
+        db_free(&hold[i]);
+    }
+
+    waitpid(s->cp.pid, &status, 0);
+    exit_code = exit_code_of(status);
+    trace_event(&s->cp, CLI_TRACE_EXIT, -1, exit_code, NULL, 0, 0);
+
+    s->exit_code = exit_code;
+    atomic_store(&s->finished, true);
+
+    /* With a ring, on_exit is delivered by cli_session_dispatch() once drained */
+    if (s->ring)
+        ring_notify(s->ring, &s->ring->cons_waiting, &s->ring->not_empty);
+    else if (s->cb.on_exit)
+        s->cb.on_exit(s, exit_code);
+
+    return NULL;
+}
+
+
+/*************************************
+ * Static Functions (Supervisor API) *
+ *************************************/
+static void sup_wake(cli_supervisor_t *sup)
+{
+    if (write(sup->ctl_pipe[1], "X", 1))
+    {
+        /* ignore: a wakeup is already pending when the pipe is full */
+    };
+}
+
+static void daemon_free(daemon_t *d)
+{
+    /* Local Variables */
+    char **a;
+
+    if (!d)
+        return;
+    for (a = d->argv; a && *a; a++)
+        free(*a);
+    free(d->argv);
+    free(d->cmd);
+    free((char *)d->ready_pat.pattern);
+    if (d->ready)
+        matchers_free(d->ready, 1);
+    close_fd(&d->file_fd[0]);
+    close_fd(&d->file_fd[1]);
+    close_fd(&d->out_fd[0]);
+    close_fd(&d->out_fd[1]);
+    close_fd(&d->pidfd);
+    free(d);
+}
+
+/* Changes state under the lock and reports it with the lock released */
+static void daemon_set_state(cli_supervisor_t *sup, daemon_t *d,
+                             cli_daemon_state_t state, int exit_code)
+{
+    d->state = state;
+    if (d->o.on_state)
+    {
+        pthread_mutex_unlock(&sup->lock);
+        d->o.on_state(sup, d->id, state, exit_code, d->o.user);
+        pthread_mutex_lock(&sup->lock);
+    }
+}
+
+/* Output goes through a pipe only when the library must look at it, */
+/* otherwise straight to the file (or /dev/null)                     */
+static bool daemon_needs_pipe(const daemon_t *d, int k)
+{
+    return d->o.on_output || (k == 0 && d->ready);
+}
+
+static int daemon_spawn(daemon_t *d)
+{
+    /* Local Variables */
+    int   p[2][2] = { { -1, -1 }, { -1, -1 } },
+          child_fd[2],
+          devnull,
+          k;
+    pid_t pid;
+
+    devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (devnull < 0)
+        return -1;
+
+    for (k = 0; k < 2; k++)
+    {
+        if (daemon_needs_pipe(d, k))
+        {
+            if (pipe_cloexec(p[k]) < 0)
+                goto fail;
+            child_fd[k] = p[k][1];
+        }
+        else
+            child_fd[k] = (d->file_fd[k] >= 0) ? d->file_fd[k] : devnull;
+    }
+
+    pid = fork();
+    if (pid < 0)
+        goto fail;
+
+    if (pid == 0)
+    {
+        /* Detach: own session and process group, no controlling tty */
+        setsid();
+        child_dup(devnull, STDIN_FILENO);
+        child_dup(child_fd[0], STDOUT_FILENO);
+        child_dup(child_fd[1], STDERR_FILENO);
+
+        execvp(d->cmd, d->argv);
+        _exit(127);
+    }
+
+    close(devnull);
+    for (k = 0; k < 2; k++)
+    {
+        close_fd(&p[k][1]);
+        d->out_fd[k] = p[k][0];
+        if (d->out_fd[k] >= 0)
+            set_nonblock(d->out_fd[k]);
+    }
+
+    d->pid = pid;
+    d->pidfd = pidfd_open_compat(pid);
+    d->started_at = now_ms();
+    d->timed_out = false;
+    d->ready_at = (d->ready && d->o.ready_timeout_ms > 0) ? d->started_at + d->o.ready_timeout_ms : 0;
+    if (d->ready)
+        d->ready->state[0] = 0;
+    d->state = d->ready ? CLI_DAEMON_STARTING : CLI_DAEMON_READY;
+
+    return 0;
+
+fail:
+    {
+        int e = errno;
+        close(devnull);
+        for (k = 0; k < 2; k++)
+        {
+            close_fd(&p[k][0]);
+            close_fd(&p[k][1]);
+        }
+        errno = e;
+        return -1;
+    }
+}
+
+static void daemon_signal(daemon_t *d, int sig)
+{
+    /* The daemon leads its own process group: reach its children too */
+    if (d->pid > 0)
+        kill(-d->pid, sig);
+}
+
+/* Drains output stream k (to the file, the callback and the probe). */
+/* Closes it at EOF or when drain is set and nothing is left         */
+static void daemon_read(cli_supervisor_t *sup, daemon_t *d, int k, bool drain)
+{
+    /* Local Variables */
+    char    buf[8192];
+    size_t  mstart,
+            mend,
+            off;
+    ssize_t n,
+            w;
+
+    while (d->out_fd[k] >= 0)
+    {
+        n = read(d->out_fd[k], buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (n == 0 || drain || (errno != EAGAIN && errno != EWOULDBLOCK))
+                close_fd(&d->out_fd[k]);
+            return;
+        }
+
+        for (off = 0; d->file_fd[k] >= 0 && off < (size_t)n; off += w)
+        {
+            w = write(d->file_fd[k], buf + off, n - off);
+            if (w <= 0)
+                break;  /* file errors do not stop the daemon */
+        }
+
+        if (k == 0 && d->state == CLI_DAEMON_STARTING &&
+            matchers_scan(d->ready, 1, CLI_STREAM_STDOUT, buf, 0, 0, 0, n, &mstart, &mend) >= 0)
+        {
+            d->ready_at = 0;
+            daemon_set_state(sup, d, CLI_DAEMON_READY, -1);
+        }
+
+        if (d->o.on_output)
+        {
+            pthread_mutex_unlock(&sup->lock);
+            d->o.on_output(sup, d->id, CLI_STREAM_STDOUT + k, buf, n, d->o.user);
+            pthread_mutex_lock(&sup->lock);
+        }
+    }
+}
+
+/* Child reaped: decide between restart (with backoff) and stop */
+static void daemon_backoff(daemon_t *d, int64_t now)
+{
+    d->restart_at = now + d->backoff_ms;
+    d->backoff_ms = (d->backoff_ms > d->o.backoff_max_ms / 2) ? d->o.backoff_max_ms : d->backoff_ms * 2;
+}
+
+static void daemon_exited(cli_supervisor_t *sup, daemon_t *d, int status)
+{
+    /* Local Variables */
+    int64_t now = now_ms(),
+            uptime = now - d->started_at;
+    int     code = exit_code_of(status);
+    bool    restart;
+
+    daemon_read(sup, d, 0, true);
+    daemon_read(sup, d, 1, true);
+    close_fd(&d->pidfd);
+
+    d->pid = 0;
+    d->last_exit = code;
+    d->total_uptime += uptime;
+
+    restart = !d->stop_requested && !sup->destroying &&
+              (d->o.restart == CLI_RESTART_ALWAYS ||
+               (d->o.restart == CLI_RESTART_ON_FAILURE && (code != 0 || d->timed_out))) &&
+              (d->o.max_restarts < 0 ||
+               d->restarts + d->failed_spawns < (unsigned)d->o.max_restarts);
+
+    if (!restart)
+    {
+        daemon_set_state(sup, d, CLI_DAEMON_STOPPED, code);
+        return;
+    }
+
+    /* Exponential backoff, reset once an instance ran long enough */
+    if (uptime >= d->o.backoff_max_ms)
+        d->backoff_ms = d->o.backoff_min_ms;
+    daemon_backoff(d, now);
+    daemon_set_state(sup, d, CLI_DAEMON_BACKOFF, code);
+}
+
+/* Applies stop requests and expired deadlines; returns the earliest */
+/* pending deadline (-1 = none)                                      */
+static int64_t daemon_timers(cli_supervisor_t *sup, daemon_t *d)
+{
+    /* Local Variables */
+    int64_t now = now_ms();
+
+    /* The first spawn happens inside cli_supervisor_add(), report it from here */
+    if (!d->announced)
+    {
+        d->announced = true;
+        daemon_set_state(sup, d, d->state, -1);
+    }
+
+    if (d->stop_requested || sup->destroying)
+    {
+        if (d->state == CLI_DAEMON_BACKOFF)
+            daemon_set_state(sup, d, CLI_DAEMON_STOPPED, d->last_exit);
+        else if (d->state == CLI_DAEMON_STARTING || d->state == CLI_DAEMON_READY)
+        {
+            daemon_signal(d, d->o.stop_signal);
+            d->kill_at = now + d->o.stop_timeout_ms;
+            daemon_set_state(sup, d, CLI_DAEMON_STOPPING, -1);
+        }
+    }
+
+    switch (d->state)
+    {
+        case CLI_DAEMON_BACKOFF:
+            if (now < d->restart_at)
+                return d->restart_at;
+            if (daemon_spawn(d) < 0)
+            {
+                /* No instance ran: not a restart, but it uses up the budget */
+                d->failed_spawns++;
+                if (d->o.max_restarts >= 0 &&
+                    d->restarts + d->failed_spawns >= (unsigned)d->o.max_restarts)
+                {
+                    daemon_set_state(sup, d, CLI_DAEMON_STOPPED, d->last_exit);
+                    return -1;
+                }
+                daemon_backoff(d, now);
+                return d->restart_at;
+            }
+            d->restarts++;
+            daemon_set_state(sup, d, d->state, -1);
+            return d->ready_at ? d->ready_at : -1;
+
+        case CLI_DAEMON_STARTING:
+            if (!d->ready_at)
+                return -1;
+            if (now < d->ready_at)
+                return d->ready_at;
+            /* Not ready in time: stop it, the exit counts as a failure */
+            d->timed_out = true;
+            daemon_signal(d, d->o.stop_signal);
+            d->kill_at = now + d->o.stop_timeout_ms;
+            daemon_set_state(sup, d, CLI_DAEMON_STOPPING, -1);
+            return d->kill_at;
+
+        case CLI_DAEMON_STOPPING:
+            if (!d->kill_at)
+                return -1;
+            if (now < d->kill_at)
+                return d->kill_at;
+            daemon_signal(d, SIGKILL);
+            d->kill_at = 0;
+            return -1;
+
+        default:
+            return -1;
+    }
+}
+
+static void *supervisor_thread(void *arg)
+{
+    /* Local Variables */
+    cli_supervisor_t *sup = arg;
+    struct pollfd    *pfds = NULL;
+    int              *owner = NULL;
+    daemon_t         *d;
+    char              buf[64];
+    size_t            i,
+                      np,
+                      cap = 0,
+                      j;
+    int64_t           next,
+                      t;
+    int               tmo,
+                      status,
+                      k;
+    bool              polling,
+                      alive;
+
+    pthread_mutex_lock(&sup->lock);
+
+    for (;;)
+    {
+        /* Timers first, they may spawn or stop daemons */
+        next = -1;
+        polling = false;
+        alive = false;
+        for (i = 0; i < sup->n; i++)
+        {
+            d = sup->d[i];
+            t = daemon_timers(sup, d);
+            if (t >= 0 && (next < 0 || t < next))
+                next = t;
+            polling |= d->pid > 0 && d->pidfd < 0;
+            alive |= d->state != CLI_DAEMON_STOPPED;
+        }
+        if (sup->destroying && !alive)
+            break;
+
+        /* One entry for the control pipe, three per daemon at most */
+        if (cap < 1 + 3 * sup->n)
+        {
+            cap = 1 + 3 * sup->n + 16;
+            free(pfds);
+            free(owner);
+            pfds = malloc(cap * sizeof(*pfds));
+            owner = malloc(cap * sizeof(*owner));
+            if (!pfds || !owner)
+            {
+                /* Out of memory: retry later rather than lose the daemons */
+                free(pfds); free(owner);
+                pfds = NULL; owner = NULL; cap = 0;
+                pthread_mutex_unlock(&sup->lock);
+                poll(NULL, 0, 100);
+                pthread_mutex_lock(&sup->lock);
+                continue;
+            }
+        }
+        np = 0;
+        pfds[np] = (struct pollfd){ sup->ctl_pipe[0], POLLIN, 0 };
+        owner[np++] = -1;
+        for (i = 0; i < sup->n; i++)
+        {
+            d = sup->d[i];
+            for (k = 0; k < 2; k++)
+            {
+                if (d->out_fd[k] < 0)
+                    continue;
+                pfds[np] = (struct pollfd){ d->out_fd[k], POLLIN, 0 };
+                owner[np++] = (int)(3 * i + k);
+            }
+            if (d->pidfd >= 0)
+            {
+                pfds[np] = (struct pollfd){ d->pidfd, POLLIN, 0 };
+                owner[np++] = (int)(3 * i + 2);
+            }
+        }
+
+        tmo = -1;
+        if (next >= 0)
+            tmo = (next > now_ms()) ? (int)(next - now_ms()) : 0;
+        if (polling && (tmo < 0 || tmo > 100))
+            tmo = 100;  /* no pidfd support: check exits periodically */
+
+        pthread_mutex_unlock(&sup->lock);
+        if (poll(pfds, np, tmo) < 0 && errno != EINTR)
+            poll(NULL, 0, 10);
+        pthread_mutex_lock(&sup->lock);
+
+        if (pfds[0].revents)
+        {
+            while (read(sup->ctl_pipe[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+
+        for (j = 1; j < np; j++)
+        {
+            if (!pfds[j].revents)
+                continue;
+            d = sup->d[owner[j] / 3];
+            k = owner[j] % 3;
+            if (k < 2)
+                daemon_read(sup, d, k, false);
+            else if (d->pid > 0 && waitpid(d->pid, &status, WNOHANG) == d->pid)
+                daemon_exited(sup, d, status);
+        }
+
+        /* Fallback for kernels without pidfd */
+        for (i = 0; polling && i < sup->n; i++)
+        {
+            d = sup->d[i];
+            if (d->pid > 0 && d->pidfd < 0 && waitpid(d->pid, &status, WNOHANG) == d->pid)
+                daemon_exited(sup, d, status);
+        }
+    }
+
+    pthread_mutex_unlock(&sup->lock);
+    free(pfds);
+    free(owner);
+
+    return NULL;
+}
+
+
+/***************************
+ *  Public Functions (API) *
+ ***************************/
+/* One-shot execution API - Free buffers inside oneshot_result_t */
+void oneshot_result_free(oneshot_result_t *r)
+{
+    if (!r) return;
+    free(r->out);
+    free(r->err);
+    memset(r, 0, sizeof(*r));
+}
+
+/* One-shot execution API - Execute a command and wait for completion
+   - cmd           executable name (searched via PATH)
+   - argv          argv array (argv[0] should be cmd)
+   - stdin_payload optional input buffer
+   - stdin_len     size of stdin_payload
+   - timeout_ms    <0 = infinite
+   - res_out       result structure (output buffers owned by caller)
+   Returns 0 on success, -1 on error (errno set) */
+int run_oneshot(const char *cmd, char *const argv[],
+                const void *stdin_payload, size_t stdin_len,
+                int timeout_ms,
+                oneshot_result_t *res)
+{
+    return run_oneshot_ex(cmd, argv, stdin_payload, stdin_len, timeout_ms, NULL, res);
+}
+
+/* One-shot execution API - As run_oneshot(), with spawn options
+   (one-shots accept CLI_FD_INHERIT descriptors only, see
+   cli_shm_create() to share memory with the child). With
+   merge_stderr the interleaved output is returned in out, and err
+   stays empty; a stdin_payload requires CLI_STDIN_PIPE */
+int run_oneshot_ex(const char *cmd, char *const argv[],
+                   const void *stdin_payload, size_t stdin_len,
+                   int timeout_ms,
+                   const cli_spawn_opts_t *opts,
+                   oneshot_result_t *res)
+{
+    /* Local Variables */
+    oneshot_job_t  *j;
+    struct pollfd   pfds[3];
+    int             nfds,
+                    tmo,
+                    r;
+    int64_t         deadline,
+                    now;
+
+    if (!cmd || !argv || !res)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(res, 0, sizeof(*res));
+
+    if (!(j = oneshot_job_start_ex(cmd, argv, stdin_payload, stdin_len, opts)))
+        return -1;
+
+    deadline = (timeout_ms >= 0) ? now_ms() + timeout_ms : -1;
+
+    while ((r = oneshot_job_step(j)) == 0)
+    {
+        tmo = -1;
+        if (deadline >= 0)
+        {
+            now = now_ms();
+            if (now >= deadline) goto timeout;
+            tmo = (int)(deadline - now);
+        }
+
+        /* Without pidfds, the exit of the child is checked periodically */
+        nfds = oneshot_job_pollfds(j, pfds, 3);
+        if (!nfds && (tmo < 0 || tmo > ONESHOT_REAP_POLL_MS))
+            tmo = ONESHOT_REAP_POLL_MS;
+        r = poll(pfds, nfds, tmo);
+        if (r < 0 && errno != EINTR)
+            goto fail;
+    }
+    if (r < 0)
+        goto fail;
+
+    return oneshot_job_finish(j, res);
+
+timeout:
+    kill(j->cp.pid, SIGTERM);
+    trace_event(&j->cp, CLI_TRACE_SIGNAL, -1, SIGTERM, NULL, 0, 0);
+    poll(NULL, 0, 200);
+    errno = ETIMEDOUT;
+
+fail:
+    {
+        int e = errno;
+        oneshot_job_cancel(j);
+        errno = e;
+        return -1;
+    }
+}
+
+/* One-shot execution API - Start a command without waiting for it
+   Same parameters as run_oneshot(); stdin_payload must stay valid
+   until the job is finished or cancelled.
+   Returns the job, or NULL on error (errno set) */
+oneshot_job_t *oneshot_job_start(const char *cmd,
+                                 char *const argv[],
+                                 const void *stdin_payload,
+                                 size_t stdin_len)
+{
+    return oneshot_job_start_ex(cmd, argv, stdin_payload, stdin_len, NULL);
+}
+
+/* One-shot execution API - As oneshot_job_start(), with spawn options */
+/* (CLI_FD_INHERIT descriptors only)                                   */
+oneshot_job_t *oneshot_job_start_ex(const char *cmd,
+                                    char *const argv[],
+                                    const void *stdin_payload,
+                                    size_t stdin_len,
+                                    const cli_spawn_opts_t *opts)
+{
+    /* Local Variables */
+    oneshot_job_t *j;
+    size_t         i;
+
+    if (!cmd || !argv)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (opts && stdin_payload && stdin_len && opts->stdin_mode != CLI_STDIN_PIPE)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    for (i = 0; opts && opts->fds && i < opts->nfds; i++)
+    {
+        /* Nobody would serve library created channels */
+        if (opts->fds[i].kind != CLI_FD_INHERIT)
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    j = calloc(1, sizeof(*j));
+    if (!j)
+        return NULL;
+
+    if (spawn_with_pipes(cmd, argv, opts, &j->cp) < 0)
+    {
+        int e = errno;
+        free(j);
+        errno = e;
+        return NULL;
+    }
+
+    db_init(&j->out);
+    db_init(&j->err);
+    j->pidfd = pidfd_open_compat(j->cp.pid);
+    j->in = stdin_payload;
+    j->in_len = stdin_payload ? stdin_len : 0;
+    if (!j->in_len && j->cp.in_w >= 0)
+    {
+        close_fd(&j->cp.in_w);
+        trace_event(&j->cp, CLI_TRACE_EOF, CLI_STREAM_STDIN, 0, NULL, 0, 0);
+    }
+
+    return j;
+}
+
+/* One-shot execution API - Descriptors the job is waiting on
+   Fills at most max entries of pfds (3 are always enough) and
+   returns their number. Once the output is at EOF, the child exit
+   is waited on through a pidfd (Linux 5.3+); where pidfds are not
+   available no descriptor is returned until the job is complete,
+   and oneshot_job_step() should be retried periodically (10 ms) */
+int oneshot_job_pollfds(oneshot_job_t *j, struct pollfd *pfds, int max)
+{
+    /* Local Variables */
+    int n = 0;
+
+    if (!j || !pfds)
+        return 0;
+
+    if (j->cp.in_w >= 0 && n < max)
+        pfds[n++] = (struct pollfd){ j->cp.in_w, POLLOUT, 0 };
+    if (j->cp.out_r >= 0 && n < max)
+        pfds[n++] = (struct pollfd){ j->cp.out_r, POLLIN, 0 };
+    if (j->cp.err_r >= 0 && n < max)
+        pfds[n++] = (struct pollfd){ j->cp.err_r, POLLIN, 0 };
+
+    /* Output at EOF: wait for the child exit (the output may also be */
+    /* closed long before it)                                         */
+    if (j->cp.out_r < 0 && j->cp.err_r < 0 && !j->reaped && j->pidfd >= 0 && n < max)
+        pfds[n++] = (struct pollfd){ j->pidfd, POLLIN, 0 };
+
+    return n;
+}
+
+/* One-shot execution API - Make progress without blocking
+   Writes as much of the stdin payload and reads as much output as
+   currently possible.
+   Returns 1 once stdout and stderr are at EOF and the child has been
+   reaped, 0 if the job would block (wait on oneshot_job_pollfds()),
+   -1 on error (errno set) */
+int oneshot_job_step(oneshot_job_t *j)
+{
+    /* Local Variables */
+    dynbuf_t *b;
+    int      *fd;
+    ssize_t   n;
+    int       i;
+
+    if (!j)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    while (j->cp.in_w >= 0)
+    {
+        if (j->in_off == j->in_len)
+        {
+            /* Whole payload written --> EOF on child stdin */
+            close_fd(&j->cp.in_w);
+            trace_event(&j->cp, CLI_TRACE_EOF, CLI_STREAM_STDIN, 0, NULL, 0, 0);
+            break;
+        }
+        n = write(j->cp.in_w, j->in + j->in_off, j->in_len - j->in_off);
+        if (n > 0)
+        {
+            trace_event(&j->cp, CLI_TRACE_WRITE, CLI_STREAM_STDIN, n, j->in + j->in_off, n, 0);
+            j->in_off += n;
+        }
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else
+        {
+            /* EPIPE: the child does not read its input */
+            close_fd(&j->cp.in_w);
+            trace_event(&j->cp, CLI_TRACE_EOF, CLI_STREAM_STDIN, 0, NULL, 0, 0);
+        }
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        fd = i ? &j->cp.err_r : &j->cp.out_r;
+        b = i ? &j->err : &j->out;
+
+        while (*fd >= 0)
+        {
+            /* Read straight into the result buffer */
+            if (db_reserve(b, b->len + 8192 + 1))
+            {
+                errno = ENOMEM;
+                return -1;
+            }
+            n = read(*fd, b->data + b->len, 8192);
+            if (n > 0)
+            {
+                trace_event(&j->cp, CLI_TRACE_READ, i + 1, n, b->data + b->len, n, 0);
+                b->len += n;
+                b->data[b->len] = '\0';
+            }
+            else if (n == 0)
+            {
+                /* EOF --> close descriptor */
+                trace_event(&j->cp, CLI_TRACE_EOF, i + 1, 0, NULL, 0, 0);
+                close_fd(fd);
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            else if (errno != EINTR)
+                return -1;
+        }
+    }
+
+    if (j->cp.out_r >= 0 || j->cp.err_r >= 0)
+        return 0;
+
+    /* Reap without blocking: the child may still be running */
+    while (!j->reaped)
+    {
+        pid_t p = waitpid(j->cp.pid, &j->status, WNOHANG);
+
+        if (p == j->cp.pid)
+        {
+            j->reaped = true;
+            close_fd(&j->pidfd);
+            trace_event(&j->cp, CLI_TRACE_EXIT, -1, exit_code_of(j->status), NULL, 0, 0);
+        }
+        else if (p == 0)
+            return 0;
+        else if (errno != EINTR)
+            return -1;
+    }
+
+    return 1;
+}
+
+/* One-shot execution API - Move the exit code and output of a completed
+   job (oneshot_job_step() returned 1) into res_out (buffers owned by
+   caller) and free the job. Never blocks.
+   Returns 0 on success, -1 on error (errno set, EBUSY if the job is
+   not complete: it is left untouched) */
+int oneshot_job_finish(oneshot_job_t *j, oneshot_result_t *res_out)
+{
+    if (!j || !res_out)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!j->reaped)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    close_fd(&j->cp.in_w);
+
+    res_out->exit_code = exit_code_of(j->status);
+    res_out->out = j->out.data; res_out->out_len = j->out.len;
+    res_out->err = j->err.data; res_out->err_len = j->err.len;
+    channels_close(&j->cp);
+    free(j);
+
+    return 0;
+}
+
+/* One-shot execution API - Kill the child of a job (SIGKILL), reap it */
+/* and release all job resources                                      */
+void oneshot_job_cancel(oneshot_job_t *j)
+{
+    /* Local Variables */
+    int status;
+
+    if (!j) return;
+
+    close_fd(&j->cp.in_w);
+    close_fd(&j->cp.out_r);
+    close_fd(&j->cp.err_r);
+    close_fd(&j->pidfd);
+    if (!j->reaped)
+    {
+        kill(j->cp.pid, SIGKILL);
+        trace_event(&j->cp, CLI_TRACE_SIGNAL, -1, SIGKILL, NULL, 0, 0);
+        if (waitpid(j->cp.pid, &status, 0) == j->cp.pid)
+            trace_event(&j->cp, CLI_TRACE_EXIT, -1, exit_code_of(status), NULL, 0, 0);
+    }
+    db_free(&j->out);
+    db_free(&j->err);
+    channels_close(&j->cp);
+    free(j);
+}
+
+
+/* Interactive session API - Create an interactive CLI session */
+/* Returns the pointer to the newly created session            */
+cli_session_t *cli_session_create(void)
+{
+    /* Local Variables */
+    cli_session_t *s = calloc(1, sizeof(struct cli_session));
+
+    if (s)
+        s->cp.in_w = s->cp.out_r = s->cp.err_r = s->ctl_pipe[0] = s->ctl_pipe[1] = -1;
+
+    return s;
+}
+
+/* Interactive session API - Select how callbacks are delivered
+   - mode == CLI_DELIVERY_INLINE --> callbacks are invoked by the
+                                     session thread (default)
+   - mode == CLI_DELIVERY_RING   --> the session thread pushes output
+                                     chunks into a lock-free single
+                                     producer/single consumer ring of
+                                     pooled buffers, and callbacks are
+                                     invoked by cli_session_dispatch()
+   - mode == CLI_DELIVERY_PULL   --> no session thread is created, the
+                                     caller reads output on its own
+                                     thread with cli_session_read() (or
+                                     polls the descriptors returned by
+                                     cli_session_fd()); on_stdout and
+                                     on_stderr are not used
+   - ring  optional ring configuration (NULL = defaults)
+   Must be called before cli_session_start() or after
+   cli_session_join()
+   Returns 0 on success, -1 on error (errno set, EBUSY while the
+   session is started) */
+int cli_session_set_delivery(cli_session_t *s,
+                             cli_delivery_t mode,
+                             const cli_ring_opts_t *ring)
+{
+    if (!s || mode < CLI_DELIVERY_INLINE || mode > CLI_DELIVERY_PULL ||
+        (ring && (ring->policy < CLI_RING_BLOCK || ring->policy > CLI_RING_GROW)))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (s->started)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    s->cfg.delivery = mode;
+    memset(&s->cfg.ring, 0, sizeof(s->cfg.ring));
+    if (ring)
+        s->cfg.ring = *ring;
+
+    return 0;
+}
+
+/* Interactive session API - Set spawn options (copied)
+   Extra channels are created at each cli_session_start(); the parent
+   end of a channel is returned by cli_session_fd(s, child_fd), the
+   parent mapping of a CLI_FD_MEMFD region by cli_session_shm().
+   Output of CLI_FD_PIPE_OUT/CLI_FD_SOCKETPAIR channels goes to
+   on_channel (inline or ring delivery), or to cli_session_read() in
+   pull mode. With merge_stderr, stderr is delivered as stdout, in
+   the order it was written.
+   Must be called before cli_session_start() or after
+   cli_session_join()
+   Returns 0 on success, -1 on error (errno set, EBUSY while the
+   session is started) */
+int cli_session_set_spawn_opts(cli_session_t *s, const cli_spawn_opts_t *opts)
+{
+    /* Local Variables */
+    cli_fd_spec_t *fds = NULL;
+    size_t         nfds = (opts && opts->fds) ? opts->nfds : 0;
+
+    if (!s)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (s->started)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    /* Specs are validated by spawn_with_pipes(), at start */
+    if (nfds)
+    {
+        if (!(fds = malloc(nfds * sizeof(*fds))))
+            return -1;
+        memcpy(fds, opts->fds, nfds * sizeof(*fds));
+    }
+
+    free((void *)s->cfg.spawn.fds);
+    memset(&s->cfg.spawn, 0, sizeof(s->cfg.spawn));
+    if (opts)
+        s->cfg.spawn = *opts;
+    s->cfg.spawn.fds = fds;
+    s->cfg.spawn.nfds = nfds;
+
+    return 0;
+}
+
+/* Interactive session API - Coalesce output before callbacks
+   - min_bytes     the output of a stream is held until at least
+                   min_bytes are available (0 = disabled, each read
+                   is delivered as is)...
+   - max_delay_us  ...or until its oldest byte has been held for
+                   max_delay_us microseconds, whichever comes first
+   Held output is delivered at once at the end of its stream and when
+   the session stops. Applies to inline and ring delivery (ring slots
+   still split chunks larger than slot_size), not to pull mode.
+   Must be called before cli_session_start() or after
+   cli_session_join()
+   Returns 0 on success, -1 on error (errno set, EBUSY while the
+   session is started) */
+int cli_session_set_coalesce(cli_session_t *s, size_t min_bytes, unsigned max_delay_us)
+{
+    if (!s || (min_bytes && !max_delay_us))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (s->started)
+    {
+        errno = EBUSY;
+        return -1;
+    }
+
+    s->cfg.coalesce_bytes = min_bytes;
+    s->cfg.coalesce_us = min_bytes ? max_delay_us : 0;
+
+    return 0;
+}
+
+/* Interactive session API - Start an interactive CLI session */
+/* Forks the process and launches the command cmd with its    */
+/* arguments argv[] in the child. It returns only in the      */
+/* parent, where it creates a thread which monitors the child */
+/* and handles callback functions. It returns the result of   */
+/* pthread_create(), i.e. 0 on success (CLI_DELIVERY_PULL     */
+/* sessions create no thread and return 0)                    */
+int cli_session_start(cli_session_t *s,
+                      const char *cmd,
+                      char *const argv[],
+                      const cli_callbacks_t *cb)
+{
+    /* Local Variables */
+    int r;
+
+    if (!s || !cmd || !argv)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    {
+        /* Keep configuration across the reset, release whatever a */
+        /* previous run left (ring, buffers, descriptors)          */
+        session_cfg_t cfg = s->cfg;
+
+        close_fd(&s->cp.in_w);
+        close_fd(&s->cp.out_r);
+        close_fd(&s->cp.err_r);
+        close_fd(&s->ctl_pipe[0]);
+        close_fd(&s->ctl_pipe[1]);
+        ring_destroy(s->ring);
+        db_free(&s->pend[0]);
+        db_free(&s->pend[1]);
+        channels_close(&s->cp);
+        memset(s, 0, sizeof(*s));
+        s->cfg = cfg;
+        s->cp.in_w = s->cp.out_r = s->cp.err_r = s->ctl_pipe[0] = s->ctl_pipe[1] = -1;
+    }
+    if (cb)
+        s->cb = *cb;
+
+    if (s->cfg.delivery == CLI_DELIVERY_RING && !(s->ring = ring_create(&s->cfg.ring)))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (spawn_with_pipes(cmd, argv, &s->cfg.spawn, &s->cp) < 0)
+        return -1;
+
+    if (s->cfg.delivery == CLI_DELIVERY_PULL)
+    {
+        /* The caller's thread does all the I/O */
+        atomic_store(&s->running, true);
+        s->started = true;
+        return 0;
+    }
+
+    if (pipe_cloexec(s->ctl_pipe) < 0)
+    {
+        int e = errno;
+        kill(s->cp.pid, SIGKILL);
+        errno = e;
+        return -1;
+    }
+
+    set_nonblock(s->ctl_pipe[0]);
+    set_nonblock(s->ctl_pipe[1]);
+
+    /* Set before the thread reads the configuration */
+    s->started = true;
+    if ((r = pthread_create(&s->th, NULL, session_thread, s)) != 0)
+        s->started = false;
+
+    return r;
+}
+
+/* Interactive session API - Write to child stdin */
+/* Returns bytes written or -1 on error           */
+ssize_t cli_session_write_stdin(cli_session_t *s, const void *buf, size_t n)
+{
+    /* Local Variables */
+    ssize_t w;
+
+    if (!s || s->cp.in_w < 0)
+        return -1;
+
+    w = write(s->cp.in_w, buf, n);
+    if (w > 0)
+        trace_event(&s->cp, CLI_TRACE_WRITE, CLI_STREAM_STDIN, w, buf, w, 0);
+
+    return w;
+}
+
+/* Interactive session API - Closes only the child stdin */
+/* The CLI session cannot receive any input, but stdout  */
+/* and stderr are still collected                        */
+void cli_session_close_stdin(cli_session_t *s)
+{
+    if (s && s->cp.in_w != -1)
+    {
+        close(s->cp.in_w);
+        s->cp.in_w = -1;
+        trace_event(&s->cp, CLI_TRACE_EOF, CLI_STREAM_STDIN, 0, NULL, 0, 0);
+    }
+}
+
+/* Interactive session API - Stop session
+   - sig == 0 --> closes the thread in the parent,
+                  leaves the child running
+   - sig > 0  --> closes the thread in the parent,
+                  send signal sig to child */
+int cli_session_stop(cli_session_t *s, int sig)
+{
+
+    if (!s)
+        return -1;
+
+    atomic_store(&s->running, false);
+
+    if (sig > 0)
+    {
+        kill(s->cp.pid, sig);
+        trace_event(&s->cp, CLI_TRACE_SIGNAL, -1, sig, NULL, 0, 0);
+    }
+
+    if (s->ctl_pipe[1] >= 0 && write(s->ctl_pipe[1], "X", 1))
+    {
+        /* ignore: pipe may be closed */
+    };
+
+    return 0;
+}
+
+/* Interactive session API - Dispatch queued output (CLI_DELIVERY_RING)
+   Invokes on_stdout/on_stderr on the calling thread for every chunk
+   queued in the ring, waiting up to timeout_ms (<0 = infinite) for
+   the first one. Once the child has exited and the ring is drained,
+   on_exit is invoked exactly once.
+   Returns the number of callbacks invoked (0 on timeout), or -1 with
+   errno == EPIPE when nothing else will ever be delivered */
+int cli_session_dispatch(cli_session_t *s, int timeout_ms)
+{
+    /* Local Variables */
+    ring_slot_t *slot;
+    int64_t      deadline;
+    int          count = 0;
+
+    if (!s || !s->ring)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    deadline = (timeout_ms >= 0) ? now_ms() + timeout_ms : -1;
+
+    for (;;)
+    {
+        while ((slot = ring_peek(s->ring)) != NULL)
+        {
+            session_callback(s, slot->stream, slot->data, slot->len);
+            ring_release(s->ring);
+            count++;
+        }
+        if (count)
+            return count;
+
+        if (atomic_load(&s->finished))
+        {
+            /* The session thread publishes everything before finishing */
+            if (ring_peek(s->ring))
+                continue;
+            if (!s->exit_delivered)
+            {
+                s->exit_delivered = true;
+                if (s->cb.on_exit)
+                    s->cb.on_exit(s, s->exit_code);
+                return 1;
+            }
+            errno = EPIPE;
+            return -1;
+        }
+
+        if (deadline >= 0 && now_ms() >= deadline)
+            return 0;
+
+        ring_park(s->ring, &s->ring->cons_waiting, &s->ring->not_empty,
+                  session_dispatch_ready, s, deadline);
+    }
+}
+
+/* Interactive session API - Read ring occupancy metrics */
+/* Returns 0 on success, -1 on error (errno set)         */
+int cli_session_ring_stats(cli_session_t *s, cli_ring_stats_t *st)
+{
+    /* Local Variables */
+    ring_t *r;
+
+    if (!s || !st || !s->ring)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    r = s->ring;
+    st->capacity = atomic_load(&r->capacity);
+    st->popped = atomic_load(&r->popped);
+    st->pushed = atomic_load(&r->pushed);
+    st->occupancy = (size_t)(st->pushed - st->popped);
+    st->high_watermark = atomic_load(&r->high_watermark);
+    st->dropped = atomic_load(&r->dropped);
+    st->dropped_bytes = atomic_load(&r->dropped_bytes);
+    st->stalls = atomic_load(&r->stalls);
+    st->grows = atomic_load(&r->grows);
+
+    return 0;
+}
+
+/* Interactive session API - Read child output (CLI_DELIVERY_PULL)
+   - stream      CLI_STREAM_STDOUT, CLI_STREAM_STDERR or the child_fd
+                 of a CLI_FD_PIPE_OUT/CLI_FD_SOCKETPAIR channel
+   - buf, n      caller buffer, filled directly by read()
+   - timeout_ms  <0 = infinite, 0 = do not wait
+   Returns bytes read, 0 at end of stream, or -1 on error
+   (errno == ETIMEDOUT when no data arrived in time) */
+ssize_t cli_session_read(cli_session_t *s,
+                         int stream,
+                         void *buf,
+                         size_t n,
+                         int timeout_ms)
+{
+    /* Local Variables */
+    channel_t *c = NULL;
+    int       *fd;
+    int64_t    deadline;
+    int        tmo,
+               r;
+    ssize_t    got;
+
+    if (!s || !buf || s->cfg.delivery != CLI_DELIVERY_PULL ||
+        (stream != CLI_STREAM_STDOUT && stream != CLI_STREAM_STDERR &&
+         (!(c = session_channel(s, stream)) || !channel_readable(c))))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!c)
+    {
+        /* Serve output buffered by cli_session_expect() first */
+        dynbuf_t *b = &s->pend[stream - 1];
+        size_t    avail = b->len - s->pend_off[stream - 1];
+
+        if (avail)
+        {
+            got = (ssize_t)((avail < n) ? avail : n);
+            memcpy(buf, b->data + s->pend_off[stream - 1], got);
+            s->pend_off[stream - 1] += got;
+            if (s->pend_off[stream - 1] == b->len)
+                b->len = s->pend_off[stream - 1] = 0;
+            return got;
+        }
+    }
+
+    fd = session_stream_fd(s, stream);
+    if (*fd < 0)
+        return 0;
+
+    deadline = (timeout_ms >= 0) ? now_ms() + timeout_ms : -1;
+
+    for (;;)
+    {
+        /* Try the read first: when data is already there, it costs */
+        /* a single syscall                                         */
+        got = read(*fd, buf, n);
+        if (got > 0)
+        {
+            trace_event(&s->cp, CLI_TRACE_READ, stream, got, buf, got, 0);
+            return got;
+        }
+        if (got == 0)
+        {
+            /* EOF --> close descriptor */
+            trace_event(&s->cp, CLI_TRACE_EOF, stream, 0, NULL, 0, 0);
+            close_fd(fd);
+            return 0;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+
+        tmo = -1;
+        if (deadline >= 0)
+        {
+            tmo = (int)(deadline - now_ms());
+            if (tmo < 0)
+                tmo = 0;
+        }
+
+        struct pollfd pfd = { *fd, POLLIN, 0 };
+        r = poll(&pfd, 1, tmo);
+        if (r < 0 && errno != EINTR)
+            return -1;
+        if (r == 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+}
+
+/* Interactive session API - Wait for one of several patterns in the output
+   (CLI_DELIVERY_PULL)
+   - patterns    array of npatterns literal or regex patterns
+   - timeout_ms  <0 = infinite
+   - res         optional result (buffer owned by caller)
+   Output is scanned incrementally as it is read, so matches split across
+   reads are found; while waiting, only the last lookback window bytes of
+   each stream are retained (see cli_session_set_expect_window()). Output
+   following the match stays buffered for the next cli_session_expect() or
+   cli_session_read().
+   Returns the index of the matched pattern, or -1 on error (errno ==
+   ETIMEDOUT on timeout, EPIPE if the watched streams reached EOF) */
+int cli_session_expect(cli_session_t *s,
+                       const cli_pattern_t *patterns,
+                       size_t npatterns,
+                       int timeout_ms,
+                       cli_expect_result_t *res)
+{
+    /* Local Variables */
+    matcher_t    *m;
+    dynbuf_t     *b;
+    struct pollfd pfds[2];
+    size_t        window,
+                  scanned[2],
+                  wstart,
+                  mstart = 0,
+                  mend = 0,
+                  i;
+    bool          watch[2] = { false, false };
+    int64_t       deadline;
+    int           idx = -1,
+                  st = 0,
+                  tmo,
+                  r,
+                  k;
+    ssize_t       n;
+
+    if (res)
+        memset(res, 0, sizeof(*res));
+    if (!s || !patterns || !npatterns || s->cfg.delivery != CLI_DELIVERY_PULL)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(m = matchers_build(patterns, npatterns)))
+        return -1;
+
+    for (i = 0; i < npatterns; i++)
+    {
+        watch[0] |= patterns[i].stream != CLI_STREAM_STDERR;
+        watch[1] |= patterns[i].stream != CLI_STREAM_STDOUT;
+    }
+
+    window = s->cfg.expect_window ? s->cfg.expect_window : 65536;
+    deadline = (timeout_ms >= 0) ? now_ms() + timeout_ms : -1;
+    scanned[0] = s->pend_off[0];
+    scanned[1] = s->pend_off[1];
+
+    for (;;)
+    {
+        /* Scan what has not been seen yet (first pass: data left over */
+        /* by previous calls)                                          */
+        for (k = 0; k < 2 && idx < 0; k++)
+        {
+            b = &s->pend[k];
+            if (!watch[k] || scanned[k] == b->len)
+                continue;
+            wstart = (b->len - s->pend_off[k] > window) ? b->len - window : s->pend_off[k];
+            idx = matchers_scan(m, npatterns, k + 1, b->data, wstart, s->pend_off[k],
+                                scanned[k], b->len, &mstart, &mend);
+            scanned[k] = b->len;
+            st = k + 1;
+
+            /* Bounded lookback: forget what slid out of the window */
+            if (idx < 0 && s->pend_off[k] < wstart)
+            {
+                s->pend_off[k] = wstart;
+                if (wstart > window)
+                {
+                    pend_compact(s, k);
+                    scanned[k] = b->len;
+                }
+            }
+        }
+        if (idx >= 0)
+            break;
+
+        /* Read more output from the watched streams */
+        for (k = 0; k < 2; k++)
+        {
+            pfds[k].fd = watch[k] ? *session_stream_fd(s, k + 1) : -1;
+            pfds[k].events = POLLIN;
+            pfds[k].revents = 0;
+        }
+        if (pfds[0].fd < 0 && pfds[1].fd < 0)
+        {
+            errno = EPIPE;
+            break;
+        }
+
+        tmo = -1;
+        if (deadline >= 0)
+        {
+            tmo = (int)(deadline - now_ms());
+            if (tmo < 0)
+                tmo = 0;
+        }
+        r = poll(pfds, 2, tmo);
+        if (r < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (r == 0)
+        {
+            errno = ETIMEDOUT;
+            break;
+        }
 
-    //pipe(s->ctl_pipe);
-    if (pipe(s->ctl_pipe) < 0)
-    {
-        int e = errno;
-        kill(s->cp.pid, SIGKILL);
-        errno = e;
-        return -1;
+        for (k = 0; k < 2; k++)
+        {
+            if (pfds[k].fd < 0 || !(pfds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+
+            /* Read straight into the pending buffer, kept NUL terminated */
+            b = &s->pend[k];
+            if (db_reserve(b, b->len + 8192 + 1))
+            {
+                errno = ENOMEM;
+                goto done;
+            }
+            n = read(pfds[k].fd, b->data + b->len, 8192);
+            if (n > 0)
+            {
+                trace_event(&s->cp, CLI_TRACE_READ, k + 1, n, b->data + b->len, n, 0);
+                b->len += n;
+                b->data[b->len] = '\0';
+            }
+            else if (n == 0)
+            {
+                trace_event(&s->cp, CLI_TRACE_EOF, k + 1, 0, NULL, 0, 0);
+                close_fd(session_stream_fd(s, k + 1));
+            }
+            else if (errno != EAGAIN && errno != EINTR)
+                goto done;
+        }
     }
 
-    set_nonblock(s->ctl_pipe[0]);
-    set_nonblock(s->ctl_pipe[1]);
+done:
+    if (idx >= 0)
+    {
+        b = &s->pend[st - 1];
+        if (res)
+        {
+            res->index = idx;
+            res->stream = st;
+            res->len = mend - s->pend_off[st - 1];
+            res->match_off = mstart - s->pend_off[st - 1];
+            res->match_len = mend - mstart;
+            res->data = malloc(res->len + 1);
+            if (res->data)
+            {
+                memcpy(res->data, b->data + s->pend_off[st - 1], res->len);
+                res->data[res->len] = '\0';
+            }
+        }
+        s->pend_off[st - 1] = mend;
+    }
+    pend_compact(s, 0);
+    pend_compact(s, 1);
+    matchers_free(m, npatterns);
 
-    return pthread_create(&s->th, NULL, session_thread, s);
+    return idx;
 }
 
-/* Interactive session API - Write to child stdin */
-/* Returns bytes written or -1 on error           */
-ssize_t cli_session_write_stdin(cli_session_t *s, const void *buf, size_t n)
+/* Interactive session API - Free buffers inside cli_expect_result_t */
+void cli_expect_result_free(cli_expect_result_t *r)
 {
-    return (!s || s->cp.in_w < 0) ? -1 : write(s->cp.in_w, buf, n);
+    if (!r) return;
+    free(r->data);
+    memset(r, 0, sizeof(*r));
 }
 
-/* Interactive session API - Closes only the child stdin */
-/* The CLI session cannot receive any input, but stdout  */
-/* and stderr are still collected                        */
-void cli_session_close_stdin(cli_session_t *s)
+/* Interactive session API - Set the cli_session_expect() lookback window */
+/* in bytes per stream (0 = 65536). Returns 0 on success, -1 on error     */
+int cli_session_set_expect_window(cli_session_t *s, size_t bytes)
 {
-    if (s && s->cp.in_w != -1)
+    if (!s)
     {
-        close(s->cp.in_w);
-        s->cp.in_w = -1;
+        errno = EINVAL;
+        return -1;
     }
+    s->cfg.expect_window = bytes;
+
+    return 0;
 }
 
-/* Interactive session API - Stop session
-   - sig == 0 --> closes the thread in the parent,
-                  leaves the child running
-   - sig > 0  --> closes the thread in the parent,
-                  send signal sig to child */
-int cli_session_stop(cli_session_t *s, int sig)
+/* Interactive session API - Parent side descriptor of a child stream */
+/* or extra channel (stream == child_fd), owned by the session and    */
+/* suitable for the caller's own poll()/epoll() loop (stdio and       */
+/* channel pipes are non-blocking). Returns -1 if the stream is closed */
+int cli_session_fd(cli_session_t *s, int stream)
 {
+    /* Local Variables */
+    int *fd;
 
-    if (!s)
+    if (!s || !(fd = session_stream_fd(s, stream)))
+    {
+        errno = EINVAL;
         return -1;
+    }
 
-    atomic_store(&s->running, false);
+    return *fd;
+}
 
-    if (sig > 0)
-        kill(s->cp.pid, sig);
+/* Interactive session API - Parent mapping of a CLI_FD_MEMFD channel */
+/* Returns its address (and size, if not NULL), or NULL on error      */
+void *cli_session_shm(cli_session_t *s, int child_fd, size_t *size)
+{
+    /* Local Variables */
+    channel_t *c;
 
-    if (write(s->ctl_pipe[1], "X", 1))
+    if (!s || !(c = session_channel(s, child_fd)) || c->kind != CLI_FD_MEMFD)
     {
-        /* ignore: pipe may be closed */
-    };
+        errno = EINVAL;
+        return NULL;
+    }
+    if (size)
+        *size = c->size;
 
-    return 0;
+    return c->map;
+}
+
+/* Shared memory - Create an anonymous shared memory region (memfd)
+   of size bytes, mapped read/write at *addr. The descriptor can be
+   given to children (CLI_FD_INHERIT), which map it on their side.
+   Release with munmap(*addr, size) and close().
+   Returns the descriptor (close-on-exec), or -1 on error (errno set) */
+int cli_shm_create(const char *name, size_t size, void **addr)
+{
+    if (!size || !addr)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return shm_create(name, size, addr);
+}
+
+/* Interactive session API - User pointer given in cli_callbacks_t */
+void *cli_session_user(cli_session_t *s)
+{
+    return s ? s->cb.user : NULL;
+}
+
+/* Interactive session API - Exit code of the child once reaped */
+/* (exit status or 128+signal). Returns -1 if not yet available */
+int cli_session_exit_code(cli_session_t *s)
+{
+    return (s && atomic_load(&s->finished)) ? s->exit_code : -1;
 }
 
 /* Interactive session API - Wait for session thread to exit */
+/* (CLI_DELIVERY_PULL: wait for the child and invoke on_exit) */
 int cli_session_join(cli_session_t *s)
 {
+    /* Local Variables */
+    int status;
+
     if (!s) return -1;
 
-    pthread_join(s->th, NULL);
+    if (s->cfg.delivery != CLI_DELIVERY_PULL)
+    {
+        if (s->started)
+            pthread_join(s->th, NULL);
+        s->started = false;
+        return 0;
+    }
+
+    if (atomic_load(&s->finished) || s->cp.pid <= 0)
+    {
+        s->started = false;
+        return 0;
+    }
+
+    while (waitpid(s->cp.pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    s->exit_code = exit_code_of(status);
+    trace_event(&s->cp, CLI_TRACE_EXIT, -1, s->exit_code, NULL, 0, 0);
+    atomic_store(&s->finished, true);
+    atomic_store(&s->running, false);
+    s->started = false;
+    if (s->cb.on_exit)
+        s->cb.on_exit(s, s->exit_code);
 
     return 0;
 }
@@ -545,5 +2951,405 @@ int cli_session_join(cli_session_t *s)
 void cli_session_destroy(cli_session_t *s)
 {
     if (!s) return;
+    close_fd(&s->cp.in_w);
+    close_fd(&s->cp.out_r);
+    close_fd(&s->cp.err_r);
+    close_fd(&s->ctl_pipe[0]);
+    close_fd(&s->ctl_pipe[1]);
+    ring_destroy(s->ring);
+    db_free(&s->pend[0]);
+    db_free(&s->pend[1]);
+    channels_close(&s->cp);
+    free((void *)s->cfg.spawn.fds);
     free(s);
 }
+
+
+/* Supervisor API - Create a supervisor and start its event thread   */
+/* A single thread monitors every daemon through pidfds (Linux 5.3+) */
+/* and drains their output. Returns NULL on error (errno set)        */
+cli_supervisor_t *cli_supervisor_create(void)
+{
+    /* Local Variables */
+    cli_supervisor_t *sup;
+    int               rc;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    sup = calloc(1, sizeof(*sup));
+    if (!sup)
+        return NULL;
+
+    if (pipe_cloexec(sup->ctl_pipe) < 0)
+    {
+        free(sup);
+        return NULL;
+    }
+    set_nonblock(sup->ctl_pipe[0]);
+    set_nonblock(sup->ctl_pipe[1]);
+    pthread_mutex_init(&sup->lock, NULL);
+
+    rc = pthread_create(&sup->th, NULL, supervisor_thread, sup);
+    if (rc != 0)
+    {
+        close(sup->ctl_pipe[0]);
+        close(sup->ctl_pipe[1]);
+        pthread_mutex_destroy(&sup->lock);
+        free(sup);
+        errno = rc;
+        return NULL;
+    }
+
+    return sup;
+}
+
+/* Supervisor API - Start a detached daemon (own session, stdin from
+   /dev/null) managed with the given options.
+   Returns the daemon id (>= 0), or -1 on error (errno set) */
+int cli_supervisor_add(cli_supervisor_t *sup, const cli_daemon_opts_t *opts)
+{
+    /* Local Variables */
+    daemon_t  *d;
+    daemon_t **nd;
+    size_t     argc,
+               i;
+    int        k,
+               id;
+
+    if (!sup || !opts || !opts->cmd || !opts->argv ||
+        opts->restart < CLI_RESTART_NEVER || opts->restart > CLI_RESTART_ALWAYS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    d = calloc(1, sizeof(*d));
+    if (!d)
+        return -1;
+    d->file_fd[0] = d->file_fd[1] = d->out_fd[0] = d->out_fd[1] = d->pidfd = -1;
+    d->last_exit = -1;
+
+    /* Options are copied: argv and strings need not outlive this call */
+    d->o = *opts;
+    d->o.backoff_min_ms = (opts->backoff_min_ms > 0) ? opts->backoff_min_ms : 100;
+    d->o.backoff_max_ms = (opts->backoff_max_ms > 0) ? opts->backoff_max_ms : 30000;
+    if (d->o.backoff_max_ms < d->o.backoff_min_ms)
+        d->o.backoff_max_ms = d->o.backoff_min_ms;
+    d->o.stop_signal = (opts->stop_signal > 0) ? opts->stop_signal : SIGTERM;
+    d->o.stop_timeout_ms = (opts->stop_timeout_ms > 0) ? opts->stop_timeout_ms : 5000;
+    d->o.stdout_path = d->o.stderr_path = d->o.ready_pattern = NULL;
+    d->o.argv = NULL;
+    d->backoff_ms = d->o.backoff_min_ms;
+
+    for (argc = 0; opts->argv[argc]; argc++)
+        ;
+    d->cmd = strdup(opts->cmd);
+    d->argv = calloc(argc + 1, sizeof(char *));
+    if (!d->cmd || !d->argv)
+        goto fail;
+    for (i = 0; i < argc; i++)
+    {
+        if (!(d->argv[i] = strdup(opts->argv[i])))
+            goto fail;
+    }
+
+    if (opts->ready_pattern)
+    {
+        d->ready_pat.pattern = strdup(opts->ready_pattern);
+        d->ready_pat.kind = CLI_EXPECT_LITERAL;
+        d->ready_pat.stream = CLI_STREAM_STDOUT;
+        if (!d->ready_pat.pattern || !(d->ready = matchers_build(&d->ready_pat, 1)))
+            goto fail;
+    }
+
+    for (k = 0; k < 2; k++)
+    {
+        const char *path = k ? opts->stderr_path : opts->stdout_path;
+
+        if (path && (d->file_fd[k] = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+            goto fail;
+    }
+
+    pthread_mutex_lock(&sup->lock);
+    if (sup->destroying)
+    {
+        pthread_mutex_unlock(&sup->lock);
+        errno = ESHUTDOWN;
+        goto fail;
+    }
+    if (sup->n == sup->cap)
+    {
+        nd = realloc(sup->d, (sup->cap ? sup->cap * 2 : 16) * sizeof(*nd));
+        if (!nd)
+        {
+            pthread_mutex_unlock(&sup->lock);
+            errno = ENOMEM;
+            goto fail;
+        }
+        sup->d = nd;
+        sup->cap = sup->cap ? sup->cap * 2 : 16;
+    }
+    if (daemon_spawn(d) < 0)
+    {
+        pthread_mutex_unlock(&sup->lock);
+        goto fail;
+    }
+    id = d->id = (int)sup->n;
+    sup->d[sup->n++] = d;
+    pthread_mutex_unlock(&sup->lock);
+    sup_wake(sup);
+
+    return id;
+
+fail:
+    {
+        int e = errno;
+        daemon_free(d);
+        errno = e;
+        return -1;
+    }
+}
+
+/* Supervisor API - Stop a daemon gracefully: stop_signal, then SIGKILL */
+/* after stop_timeout_ms. Asynchronous: the state becomes               */
+/* CLI_DAEMON_STOPPED once the daemon has exited                        */
+int cli_supervisor_stop(cli_supervisor_t *sup, int id)
+{
+    if (!sup || id < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&sup->lock);
+    if ((size_t)id >= sup->n)
+    {
+        pthread_mutex_unlock(&sup->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    sup->d[id]->stop_requested = true;
+    pthread_mutex_unlock(&sup->lock);
+    sup_wake(sup);
+
+    return 0;
+}
+
+/* Supervisor API - Read state, restart count and uptime of a daemon */
+/* Returns 0 on success, -1 on error (errno set)                     */
+int cli_supervisor_status(cli_supervisor_t *sup, int id, cli_daemon_status_t *st)
+{
+    /* Local Variables */
+    daemon_t *d;
+    int64_t   now = now_ms();
+
+    if (!sup || id < 0 || !st)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&sup->lock);
+    if ((size_t)id >= sup->n)
+    {
+        pthread_mutex_unlock(&sup->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    d = sup->d[id];
+    st->state = d->state;
+    st->pid = d->pid;
+    st->restarts = d->restarts;
+    st->uptime_ms = d->pid > 0 ? now - d->started_at : 0;
+    st->total_uptime_ms = d->total_uptime + st->uptime_ms;
+    st->last_exit_code = d->last_exit;
+    pthread_mutex_unlock(&sup->lock);
+
+    return 0;
+}
+
+/* Supervisor API - Stop all daemons (as cli_supervisor_stop()), wait */
+/* for them and for the event thread, release all resources           */
+void cli_supervisor_destroy(cli_supervisor_t *sup)
+{
+    /* Local Variables */
+    size_t i;
+
+    if (!sup) return;
+
+    pthread_mutex_lock(&sup->lock);
+    sup->destroying = true;
+    pthread_mutex_unlock(&sup->lock);
+    sup_wake(sup);
+    pthread_join(sup->th, NULL);
+
+    for (i = 0; i < sup->n; i++)
+        daemon_free(sup->d[i]);
+    free(sup->d);
+    close(sup->ctl_pipe[0]);
+    close(sup->ctl_pipe[1]);
+    pthread_mutex_destroy(&sup->lock);
+    free(sup);
+}
+
+
+/* Trace recorder - Create (truncate) a trace file
+   - flags  0 or CLI_TRACE_PAYLOAD
+   Records are buffered in memory and written in large blocks; the
+   recorder is thread safe and can be given to any number of sessions
+   and one-shots through cli_spawn_opts_t.trace.
+   Returns the recorder, or NULL on error (errno set) */
+cli_trace_t *cli_trace_open(const char *path, unsigned flags)
+{
+    /* Local Variables */
+    cli_trace_t *t;
+    trace_hdr_t  hdr;
+
+    if (!path || (flags & ~CLI_TRACE_PAYLOAD))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    t = calloc(1, sizeof(*t));
+    if (!t || !(t->buf = malloc(TRACE_BUFSIZE)))
+    {
+        free(t);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (t->fd < 0)
+    {
+        int e = errno;
+        free(t->buf);
+        free(t);
+        errno = e;
+        return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    t->flags = flags;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.flags = flags;
+    trace_put(t, &hdr, sizeof(hdr));
+
+    return t;
+}
+
+/* Trace recorder - Write buffered records to the file */
+/* Returns 0 on success, -1 on error (errno set)       */
+int cli_trace_flush(cli_trace_t *t)
+{
+    /* Local Variables */
+    int r;
+
+    if (!t)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&t->lock);
+    r = trace_flush_locked(t);
+    if (r < 0)
+        errno = t->err;
+    pthread_mutex_unlock(&t->lock);
+
+    return r;
+}
+
+/* Trace recorder - Flush and close the trace file. The recorder must no
+   longer be in use by any session or one-shot.
+   Returns 0 on success, -1 if any record could not be written (errno set) */
+int cli_trace_close(cli_trace_t *t)
+{
+    /* Local Variables */
+    int e;
+
+    if (!t)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    trace_flush_locked(t);
+    if (close(t->fd) < 0 && !t->err)
+        t->err = errno;
+    e = t->err;
+    pthread_mutex_destroy(&t->lock);
+    free(t->buf);
+    free(t);
+
+    if (e)
+    {
+        errno = e;
+        return -1;
+    }
+    return 0;
+}
+
+/* Trace replay - Read a trace file and invoke cb for each record, in
+   recording order (e.g. to feed recorded CLI_TRACE_READ payloads to
+   on_stdout callbacks for offline benchmarking).
+   Returns the number of records, or -1 on error (errno set, EINVAL
+   for a file that is not a trace) */
+long cli_trace_replay(const char *path, cli_trace_on_record cb, void *user)
+{
+    /* Local Variables */
+    FILE               *f;
+    trace_hdr_t         hdr;
+    cli_trace_record_t  rec;
+    dynbuf_t            data;
+    long                count = 0;
+    int                 e = 0;
+
+    if (!path || !cb)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!(f = fopen(path, "rb")))
+        return -1;
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) || hdr.version != TRACE_VERSION)
+    {
+        fclose(f);
+        errno = EINVAL;
+        return -1;
+    }
+
+    db_init(&data);
+
+    /* A record truncated by a crash of the recording process ends the trace */
+    while (fread(&rec, sizeof(rec), 1, f) == 1)
+    {
+        if (db_reserve(&data, (size_t)rec.len + 1))
+        {
+            e = ENOMEM;
+            break;
+        }
+        if (rec.len && fread(data.data, rec.len, 1, f) != 1)
+            break;
+        data.data[rec.len] = '\0';
+        count++;
+        if (cb(&rec, data.data, user))
+            break;
+    }
+    if (!e && ferror(f))
+        e = EIO;
+
+    db_free(&data);
+    fclose(f);
+
+    if (e)
+    {
+        errno = e;
+        return -1;
+    }
+    return count;
+}
@@ -0,0 +1,381 @@
+// tools/clitrace.c
+//
+// Analysis of the binary I/O traces written by cli_trace_open():
+//
+//   clitrace summary  FILE              per child latency and throughput figures
+//   clitrace timeline FILE [PID]        every event, relative to the child spawn
+//   clitrace replay   FILE [PID] [N]    feed recorded stdout (CLI_TRACE_PAYLOAD
+//                                       traces) N times to an on_stdout callback
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "clirunner.h"
+
+static const char *event_name[] = { "?", "spawn", "read", "write", "signal", "eof", "exit", "callback" };
+
+/* Per child figures, one entry per CLI_TRACE_SPAWN */
+typedef struct
+{
+    int32_t  pid;
+    char     cmd[64];
+    uint64_t spawn_ts;
+    uint64_t exit_ts;
+    int64_t  exit_code;
+    uint64_t first_read;          /* 0 = no output */
+    uint64_t last_read;
+    uint64_t max_gap;             /* longest silence between two reads */
+    uint64_t reads[3],            /* stdout, stderr, channels */
+             bytes[3];
+    uint64_t writes,
+             written;
+    uint64_t pending_write;       /* oldest write not answered yet, 0 = none */
+    uint64_t responses,
+             resp_total,
+             resp_max;
+    uint64_t callbacks,
+             cb_total,
+             cb_max;
+    unsigned signals;
+    uint64_t last_event;          /* timeline only */
+} child_t;
+
+typedef struct
+{
+    child_t *c;
+    size_t   n;
+    size_t   cap;
+} children_t;
+
+/* Latest child with the given pid (pids may be reused) */
+static child_t *child_find(children_t *cs, int32_t pid)
+{
+    for (size_t i = cs->n; i-- > 0; )
+    {
+        if (cs->c[i].pid == pid)
+            return &cs->c[i];
+    }
+    return NULL;
+}
+
+static int summary_record(const cli_trace_record_t *r, const void *data, void *user)
+{
+    children_t *cs = user;
+    child_t    *c;
+    int         k;
+
+    if (r->type == CLI_TRACE_SPAWN)
+    {
+        if (cs->n == cs->cap)
+        {
+            size_t   ncap = cs->cap ? cs->cap * 2 : 16;
+            child_t *p = realloc(cs->c, ncap * sizeof(child_t));
+
+            if (!p)
+                return 1;
+            cs->c = p;
+            cs->cap = ncap;
+        }
+        c = &cs->c[cs->n++];
+        memset(c, 0, sizeof(*c));
+        c->pid = r->pid;
+        c->spawn_ts = r->ts_ns;
+        c->exit_code = -1;
+        snprintf(c->cmd, sizeof(c->cmd), "%.*s", (int)r->len, (const char *)data);
+        return 0;
+    }
+
+    if (!(c = child_find(cs, r->pid)))
+        return 0;   /* spawned before the trace was opened */
+
+    switch (r->type)
+    {
+        case CLI_TRACE_READ:
+            k = (r->stream == CLI_STREAM_STDOUT) ? 0 : (r->stream == CLI_STREAM_STDERR) ? 1 : 2;
+            c->reads[k]++;
+            c->bytes[k] += r->value;
+            if (!c->first_read)
+                c->first_read = r->ts_ns;
+            else if (r->ts_ns - c->last_read > c->max_gap)
+                c->max_gap = r->ts_ns - c->last_read;
+            c->last_read = r->ts_ns;
+            if (c->pending_write)
+            {
+                /* First output after an input: the child response time */
+                uint64_t d = r->ts_ns - c->pending_write;
+
+                c->responses++;
+                c->resp_total += d;
+                if (d > c->resp_max)
+                    c->resp_max = d;
+                c->pending_write = 0;
+            }
+            break;
+
+        case CLI_TRACE_WRITE:
+            c->writes++;
+            c->written += r->value;
+            if (!c->pending_write)
+                c->pending_write = r->ts_ns;
+            break;
+
+        case CLI_TRACE_CALLBACK:
+            c->callbacks++;
+            c->cb_total += r->value;
+            if ((uint64_t)r->value > c->cb_max)
+                c->cb_max = r->value;
+            break;
+
+        case CLI_TRACE_SIGNAL:
+            c->signals++;
+            break;
+
+        case CLI_TRACE_EXIT:
+            c->exit_ts = r->ts_ns;
+            c->exit_code = r->value;
+            break;
+
+        default:
+            break;
+    }
+    return 0;
+}
+
+static double ms(uint64_t ns)
+{
+    return ns / 1e6;
+}
+
+static int summary(const char *path)
+{
+    children_t cs = { 0 };
+
+    if (cli_trace_replay(path, summary_record, &cs) < 0)
+    {
+        perror(path);
+        free(cs.c);
+        return 1;
+    }
+
+    for (size_t i = 0; i < cs.n; i++)
+    {
+        child_t *c = &cs.c[i];
+
+        printf("pid %" PRId32 " (%s)\n", c->pid, c->cmd);
+        if (c->exit_ts)
+            printf("  lifetime          %10.3f ms, exit code %" PRId64 ", %u signal(s)\n",
+                   ms(c->exit_ts - c->spawn_ts), c->exit_code, c->signals);
+        else
+            printf("  lifetime          (no exit recorded), %u signal(s)\n", c->signals);
+        if (c->first_read)
+            printf("  first output      %10.3f ms after spawn, longest silence %.3f ms\n",
+                   ms(c->first_read - c->spawn_ts), ms(c->max_gap));
+        printf("  stdin             %10" PRIu64 " writes, %" PRIu64 " bytes\n", c->writes, c->written);
+        printf("  stdout            %10" PRIu64 " reads,  %" PRIu64 " bytes\n", c->reads[0], c->bytes[0]);
+        printf("  stderr            %10" PRIu64 " reads,  %" PRIu64 " bytes\n", c->reads[1], c->bytes[1]);
+        if (c->reads[2])
+            printf("  channels          %10" PRIu64 " reads,  %" PRIu64 " bytes\n", c->reads[2], c->bytes[2]);
+        if (c->responses)
+            printf("  response time     %10.3f ms avg, %.3f ms max (%" PRIu64 " write/read pairs)\n",
+                   ms(c->resp_total / c->responses), ms(c->resp_max), c->responses);
+        if (c->callbacks)
+            printf("  callbacks         %10" PRIu64 " calls, %.3f ms total, %.3f ms max\n",
+                   c->callbacks, ms(c->cb_total), ms(c->cb_max));
+    }
+
+    free(cs.c);
+    return 0;
+}
+
+typedef struct
+{
+    int32_t    pid;               /* 0 = all */
+    children_t cs;
+} timeline_t;
+
+static int timeline_record(const cli_trace_record_t *r, const void *data, void *user)
+{
+    timeline_t *tl = user;
+    child_t    *c;
+    uint64_t    prev;
+
+    summary_record(r, data, &tl->cs);
+    if ((tl->pid && r->pid != tl->pid) || !(c = child_find(&tl->cs, r->pid)))
+        return 0;
+
+    prev = c->last_event ? c->last_event : c->spawn_ts;
+    c->last_event = r->ts_ns;
+
+    printf("%7" PRId32 " %+12.3f ms  (%+10.3f)  %-8s %3d  ",
+           r->pid, ms(r->ts_ns - c->spawn_ts), ms(r->ts_ns - prev),
+           r->type < sizeof(event_name) / sizeof(*event_name) ? event_name[r->type] : "?",
+           r->stream);
+    switch (r->type)
+    {
+        case CLI_TRACE_SPAWN:    printf("%s\n", c->cmd); break;
+        case CLI_TRACE_READ:
+        case CLI_TRACE_WRITE:    printf("%" PRId64 " bytes\n", r->value); break;
+        case CLI_TRACE_SIGNAL:   printf("signal %" PRId64 "\n", r->value); break;
+        case CLI_TRACE_EXIT:     printf("exit code %" PRId64 "\n", r->value); break;
+        case CLI_TRACE_CALLBACK: printf("%.3f ms\n", ms(r->value)); break;
+        default:                 printf("\n"); break;
+    }
+    return 0;
+}
+
+static int timeline(const char *path, int32_t pid)
+{
+    timeline_t tl = { .pid = pid };
+    long       n;
+
+    n = cli_trace_replay(path, timeline_record, &tl);
+    if (n < 0)
+        perror(path);
+    free(tl.cs.c);
+
+    return n < 0;
+}
+
+/* Replay: recorded stdout chunks go to a line counting consumer, */
+/* standing for an application on_stdout callback                 */
+typedef struct
+{
+    uint64_t chunks;
+    uint64_t bytes;
+    uint64_t lines;
+} replay_t;
+
+/* Payloads loaded once from the trace, so that only the consumer is timed */
+typedef struct
+{
+    int32_t  pid;                 /* 0 = all */
+    uint64_t missing;             /* stdout reads recorded without payload */
+    bool     oom;
+    char    *data;                /* all payloads, back to back */
+    size_t   len;
+    size_t   cap;
+    size_t  *chunk;               /* end offset of each payload in data */
+    size_t   n;
+    size_t   ncap;
+} payloads_t;
+
+static void consume(replay_t *rp, const char *buf, size_t n)
+{
+    for (const char *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++)
+        rp->lines++;
+    rp->chunks++;
+    rp->bytes += n;
+}
+
+static int replay_record(const cli_trace_record_t *r, const void *data, void *user)
+{
+    payloads_t *pl = user;
+
+    if (r->type != CLI_TRACE_READ || r->stream != CLI_STREAM_STDOUT ||
+        (pl->pid && r->pid != pl->pid))
+        return 0;
+    if (r->len != (uint64_t)r->value)
+    {
+        pl->missing++;
+        return 0;
+    }
+
+    if (pl->len + r->len > pl->cap)
+    {
+        size_t ncap = pl->cap ? pl->cap : 65536;
+        char  *p;
+
+        while (ncap < pl->len + r->len)
+            ncap *= 2;
+        if (!(p = realloc(pl->data, ncap)))
+            return pl->oom = true;
+        pl->data = p;
+        pl->cap = ncap;
+    }
+    if (pl->n == pl->ncap)
+    {
+        size_t  ncap = pl->ncap ? pl->ncap * 2 : 1024;
+        size_t *p = realloc(pl->chunk, ncap * sizeof(size_t));
+
+        if (!p)
+            return pl->oom = true;
+        pl->chunk = p;
+        pl->ncap = ncap;
+    }
+    memcpy(pl->data + pl->len, data, r->len);
+    pl->len += r->len;
+    pl->chunk[pl->n++] = pl->len;
+    return 0;
+}
+
+static int replay(const char *path, int32_t pid, int iterations)
+{
+    payloads_t      pl = { .pid = pid };
+    replay_t        rp = { 0 };
+    struct timespec t0, t1;
+    double          secs;
+    size_t          i,
+                    off;
+
+    if (cli_trace_replay(path, replay_record, &pl) < 0 || pl.oom)
+    {
+        if (pl.oom)
+            errno = ENOMEM;
+        perror(path);
+        free(pl.data);
+        free(pl.chunk);
+        return 1;
+    }
+
+    if (pl.missing)
+    {
+        fprintf(stderr, "%s: %" PRIu64 " stdout reads have no payload (record with CLI_TRACE_PAYLOAD)\n",
+                path, pl.missing);
+        if (!pl.n)
+        {
+            free(pl.data);
+            free(pl.chunk);
+            return 1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int it = 0; it < iterations; it++)
+    {
+        for (i = 0, off = 0; i < pl.n; off = pl.chunk[i++])
+            consume(&rp, pl.data + off, pl.chunk[i] - off);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%" PRIu64 " callbacks, %" PRIu64 " bytes, %" PRIu64 " lines in %.3f ms\n",
+           rp.chunks, rp.bytes, rp.lines, secs * 1e3);
+    if (secs > 0)
+        printf("%.0f callbacks/s, %.1f MB/s\n", rp.chunks / secs, rp.bytes / secs / 1e6);
+
+    free(pl.data);
+    free(pl.chunk);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int32_t pid = (argc > 3) ? (int32_t)atoi(argv[3]) : 0;
+
+    if (argc >= 3 && !strcmp(argv[1], "summary"))
+        return summary(argv[2]);
+    if (argc >= 3 && !strcmp(argv[1], "timeline"))
+        return timeline(argv[2], pid);
+    if (argc >= 3 && !strcmp(argv[1], "replay"))
+        return replay(argv[2], pid, (argc > 4 && atoi(argv[4]) > 0) ? atoi(argv[4]) : 1);
+
+    fprintf(stderr,
+            "usage: %s summary  FILE\n"
+            "       %s timeline FILE [PID]\n"
+            "       %s replay   FILE [PID] [ITERATIONS]\n",
+            argv[0], argv[0], argv[0]);
+    return 2;
+}